@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every allocation is rounded up to a multiple of this
+#define ARENA_ALIGN (_Alignof(max_align_t))
+// Requests larger than this get a chunk of their own instead of wasting
+// the rest of the current one
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t size;               // Usable bytes in 'data'
+    max_align_t data[];
+};
+
+void *default_malloc(void *arg, size_t size) {
+    return malloc(size);
+}
+
+void *default_realloc(void *arg, void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+void default_free(void *arg, void *ptr) {
+    free(ptr);
+}
+
+const minitar_allocator_t minitar_default_allocator = {
+    default_malloc,
+    default_realloc,
+    default_free,
+    NULL,
+};
+
+void arena_init(arena_t *arena, const minitar_allocator_t *allocator) {
+    arena->allocator = allocator;
+    arena->chunks = NULL;
+    arena->used = 0;
+}
+
+/*
+ * Get a chunk with 'size' usable bytes from the arena's allocator
+ */
+arena_chunk_t *arena_new_chunk(arena_t *arena, size_t size) {
+    const minitar_allocator_t *allocator = arena->allocator;
+    arena_chunk_t *chunk = allocator->malloc_fn(allocator->arg, sizeof(arena_chunk_t) + size);
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_CHUNK_SIZE) {
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (arena->chunks != NULL && arena->chunks->size - arena->used >= size) {
+        void *ptr = (char *) arena->chunks->data + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    if (size > ARENA_LARGE_SIZE && arena->chunks != NULL) {
+        // Slip it in behind the current chunk, which still has room for small requests
+        arena_chunk_t *chunk = arena_new_chunk(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+        return chunk->data;
+    }
+
+    size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    arena_chunk_t *chunk = arena_new_chunk(arena, chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->used = size;
+    return chunk->data;
+}
+
+char *arena_strdup(arena_t *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+/*
+ * Return every chunk in the list starting at 'chunk' to the allocator
+ */
+void arena_free_chunks(arena_t *arena, arena_chunk_t *chunk) {
+    const minitar_allocator_t *allocator = arena->allocator;
+    while (chunk != NULL) {
+        arena_chunk_t *next = chunk->next;
+        allocator->free_fn(allocator->arg, chunk);
+        chunk = next;
+    }
+}
+
+void arena_reset(arena_t *arena) {
+    if (arena->chunks != NULL) {
+        arena_free_chunks(arena, arena->chunks->next);
+        arena->chunks->next = NULL;
+    }
+    arena->used = 0;
+}
+
+void arena_free(arena_t *arena) {
+    arena_free_chunks(arena, arena->chunks);
+    arena->chunks = NULL;
+    arena->used = 0;
+}
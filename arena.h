@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+// Memory allocation functions used by an operation. Each receives 'arg' and
+// otherwise behaves like its C library namesake (free_fn ignores NULL).
+// They must be safe to call from several threads when operations run in parallel.
+typedef struct {
+    void *(*malloc_fn)(void *arg, size_t size);
+    void *(*realloc_fn)(void *arg, void *ptr, size_t size);
+    void (*free_fn)(void *arg, void *ptr);
+    void *arg;
+} minitar_allocator_t;
+
+// The C library's malloc, realloc and free
+extern const minitar_allocator_t minitar_default_allocator;
+
+// Allocations are carved out of chunks of this many bytes
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+typedef struct arena_chunk arena_chunk_t;
+
+// Bump allocator for the many small, same-lifetime allocations of one
+// operation (headers, names, list nodes). Individual allocations can't be
+// freed, everything goes at once with arena_reset or arena_free, which only
+// touch the chunks rather than every allocation.
+typedef struct {
+    const minitar_allocator_t *allocator;
+    arena_chunk_t *chunks;    // Most recently started chunk first
+    size_t used;              // Bytes handed out from the first chunk
+} arena_t;
+
+// Initialize an empty arena that gets its chunks from 'allocator', which
+// must outlive the arena
+void arena_init(arena_t *arena, const minitar_allocator_t *allocator);
+
+// Allocate 'size' bytes, suitably aligned for any type
+// Returns NULL if memory could not be allocated
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Copy the null-terminated string 's' into the arena
+// Returns NULL if memory could not be allocated
+char *arena_strdup(arena_t *arena, const char *s);
+
+// Discard every allocation but keep the most recent chunk for reuse
+void arena_reset(arena_t *arena);
+
+// Discard every allocation and return all chunks to the allocator.
+// The arena is left empty and may be used again.
+void arena_free(arena_t *arena);
+
+#endif    // _ARENA_H
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "buf_pool.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void buf_pool_init(buf_pool_t *pool, const minitar_allocator_t *allocator, size_t buffer_size,
+                   size_t max_buffers) {
+    pool->allocator = allocator;
+    pool->buffer_size = buffer_size;
+    pool->max_buffers = max_buffers;
+    pool->num_buffers = 0;
+    pool->num_idle = 0;
+    pool->per_node = 0;
+    memset(pool->idle, 0, sizeof(pool->idle));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->returned, NULL);
+}
+
+void buf_pool_init_limited(buf_pool_t *pool, const minitar_allocator_t *allocator,
+                           size_t memory_limit) {
+    if (memory_limit == 0) {
+        buf_pool_init(pool, allocator, BUF_POOL_BUFFER_SIZE, 0);
+        return;
+    }
+    size_t buffer_size = BUF_POOL_BUFFER_SIZE;
+    while (buffer_size > BUF_POOL_MIN_BUFFER_SIZE && buffer_size > memory_limit) {
+        buffer_size /= 2;
+    }
+    size_t max_buffers = memory_limit / buffer_size;
+    buf_pool_init(pool, allocator, buffer_size, max_buffers > 0 ? max_buffers : 1);
+}
+
+/*
+ * Idle list of the NUMA node the calling thread runs on
+ */
+int buf_pool_node(const buf_pool_t *pool) {
+    unsigned cpu, node;
+    if (!pool->per_node || syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return (int) (node % BUF_POOL_MAX_NODES);
+}
+
+/*
+ * Allocate one aligned buffer for idle list 'node'. The pointer the allocator
+ * returned and the node are kept in the two words just below the aligned
+ * start, so the buffer can be freed and returned to the right list later.
+ */
+void *buf_pool_alloc(buf_pool_t *pool, int node) {
+    const minitar_allocator_t *allocator = pool->allocator;
+    char *raw = allocator->malloc_fn(allocator->arg, pool->buffer_size + BUF_POOL_ALIGN);
+    if (raw == NULL) {
+        return NULL;
+    }
+    uintptr_t start = ((uintptr_t) raw + 2 * sizeof(void *) + BUF_POOL_ALIGN - 1) &
+                      ~(uintptr_t) (BUF_POOL_ALIGN - 1);
+    char *buf = (char *) start;
+    ((void **) buf)[-1] = raw;
+    ((uintptr_t *) buf)[-2] = (uintptr_t) node;
+    return buf;
+}
+
+/*
+ * Unlink the first idle buffer of 'node', or of any node if 'node' is -1
+ * Returns NULL if there is none. Called with the lock held.
+ */
+void *buf_pool_take_idle(buf_pool_t *pool, int node) {
+    for (int i = 0; i < BUF_POOL_MAX_NODES; i++) {
+        if ((node == -1 || i == node) && pool->idle[i] != NULL) {
+            void *buf = pool->idle[i];
+            pool->idle[i] = *(void **) buf;
+            pool->num_idle--;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+void *buf_pool_get(buf_pool_t *pool) {
+    int node = buf_pool_node(pool);
+    pthread_mutex_lock(&pool->lock);
+    void *buf;
+    // A local idle buffer first, then a new one (first touched here), and
+    // only at the cap an idle one from another node
+    while ((buf = buf_pool_take_idle(pool, node)) == NULL &&
+           (pool->max_buffers != 0 && pool->num_buffers >= pool->max_buffers) &&
+           (buf = buf_pool_take_idle(pool, -1)) == NULL) {
+        pthread_cond_wait(&pool->returned, &pool->lock);
+    }
+    if (buf == NULL) {
+        // Counted before allocating so the cap holds while the lock is dropped
+        pool->num_buffers++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (buf != NULL) {
+        return buf;
+    }
+
+    buf = buf_pool_alloc(pool, node);
+    if (buf == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->num_buffers--;
+        pthread_cond_broadcast(&pool->returned);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return buf;
+}
+
+int buf_pool_get_many(buf_pool_t *pool, void **bufs, size_t count) {
+    int node = buf_pool_node(pool);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->max_buffers != 0 &&
+           pool->num_idle + (pool->max_buffers - pool->num_buffers) < count) {
+        pthread_cond_wait(&pool->returned, &pool->lock);
+    }
+    size_t taken = 0;
+    for (; taken < count && pool->num_idle > 0; taken++) {
+        bufs[taken] = buf_pool_take_idle(pool, node);
+        if (bufs[taken] == NULL) {
+            bufs[taken] = buf_pool_take_idle(pool, -1);
+        }
+    }
+    // The rest are new, counted before allocating as in buf_pool_get
+    pool->num_buffers += count - taken;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (; taken < count; taken++) {
+        bufs[taken] = buf_pool_alloc(pool, node);
+        if (bufs[taken] == NULL) {
+            break;
+        }
+    }
+    if (taken == count) {
+        return 0;
+    }
+    // Give back what was got, dropping the buffers that were never allocated
+    pthread_mutex_lock(&pool->lock);
+    pool->num_buffers -= count - taken;
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < taken; i++) {
+        buf_pool_put(pool, bufs[i]);
+    }
+    return -1;
+}
+
+void buf_pool_put(buf_pool_t *pool, void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    int node = (int) ((uintptr_t *) buf)[-2];
+    pthread_mutex_lock(&pool->lock);
+    *(void **) buf = pool->idle[node];
+    pool->idle[node] = buf;
+    pool->num_idle++;
+    // Everyone waiting rechecks, as buf_pool_get_many may need more than one
+    pthread_cond_broadcast(&pool->returned);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buf_pool_free(buf_pool_t *pool) {
+    const minitar_allocator_t *allocator = pool->allocator;
+    void *buf;
+    while ((buf = buf_pool_take_idle(pool, -1)) != NULL) {
+        allocator->free_fn(allocator->arg, ((void **) buf)[-1]);
+    }
+    pool->num_buffers = 0;
+    pool->num_idle = 0;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->returned);
+}
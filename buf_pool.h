@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _BUF_POOL_H
+#define _BUF_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+// Size of the buffers that bulk data (member payloads, Merkle chunks) moves through
+#define BUF_POOL_BUFFER_SIZE (1 << 20)
+// Smallest buffer a pool hands out, however tight its memory limit
+#define BUF_POOL_MIN_BUFFER_SIZE (64 * 1024)
+// Every buffer starts on a page boundary
+#define BUF_POOL_ALIGN 4096
+// NUMA nodes a pool keeps separate idle lists for (higher nodes share them)
+#define BUF_POOL_MAX_NODES 8
+
+// Fixed-size, page-aligned I/O buffers shared by the threads of an operation.
+// Buffers are allocated on first demand and recycled afterwards. With a cap
+// on the number of buffers, buf_pool_get blocks while all of them are in
+// use, so stages that read ahead are held back until the stages consuming
+// their data hand buffers back.
+// A thread must not hold more than one buffer at a time, otherwise threads
+// waiting for each other's buffers could deadlock.
+// With 'per_node' set, a buffer remembers the NUMA node of the thread that
+// allocated (and so first touched) it, and threads get buffers of their own
+// node back where possible, allocating a new one before taking a remote one.
+typedef struct {
+    const minitar_allocator_t *allocator;
+    size_t buffer_size;
+    size_t max_buffers;     // 0 = no limit
+    size_t num_buffers;     // Allocated so far
+    size_t num_idle;        // Of those, returned and waiting for reuse
+    int per_node;           // Set right after initialization, see above
+    // Returned buffers per node (all on node 0 unless 'per_node' is set),
+    // linked through their first bytes
+    void *idle[BUF_POOL_MAX_NODES];
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+} buf_pool_t;
+
+// Prepare a pool of at most 'max_buffers' buffers of 'buffer_size' bytes
+// (0 = as many as are asked for), allocated from 'allocator'
+void buf_pool_init(buf_pool_t *pool, const minitar_allocator_t *allocator, size_t buffer_size,
+                   size_t max_buffers);
+
+// Prepare a pool whose buffers take up at most 'memory_limit' bytes in total
+// (0 = no limit). Buffers shrink below BUF_POOL_BUFFER_SIZE if the limit
+// can't hold one, down to BUF_POOL_MIN_BUFFER_SIZE.
+void buf_pool_init_limited(buf_pool_t *pool, const minitar_allocator_t *allocator,
+                           size_t memory_limit);
+
+// Take a buffer of pool->buffer_size bytes, waiting for one to be returned if needed
+// Returns NULL if memory could not be allocated
+void *buf_pool_get(buf_pool_t *pool);
+
+// Take 'count' buffers (at most the pool's cap) into 'bufs' at once, waiting
+// until that many are to be had together. A thread that needs several
+// buffers for the whole of its work takes them this way, so threads never
+// wait for each other while each holds part of what it needs.
+// Returns 0 on success or -1 if memory could not be allocated, in which case
+// nothing is taken
+int buf_pool_get_many(buf_pool_t *pool, void **bufs, size_t count);
+
+// Hand 'buf' back for reuse (NULL is ignored)
+void buf_pool_put(buf_pool_t *pool, void *buf);
+
+// Release every buffer. All of them must have been returned.
+void buf_pool_free(buf_pool_t *pool);
+
+#endif    // _BUF_POOL_H
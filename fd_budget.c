@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "fd_budget.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+void fd_budget_init(fd_budget_t *budget) {
+    long limit = 1024;
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        if (rlim.rlim_cur < rlim.rlim_max && rlim.rlim_max != RLIM_INFINITY) {
+            struct rlimit raised = {rlim.rlim_max, rlim.rlim_max};
+            if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+                rlim.rlim_cur = rlim.rlim_max;
+            }
+        }
+        limit = rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > INT_MAX ? INT_MAX
+                                                                          : (long) rlim.rlim_cur;
+    }
+    budget->total = limit > 2 * FD_BUDGET_RESERVE ? limit - FD_BUDGET_RESERVE : limit / 2;
+    if (budget->total < 1) {
+        budget->total = 1;
+    }
+    budget->available = budget->total;
+    pthread_mutex_init(&budget->lock, NULL);
+    pthread_cond_init(&budget->returned, NULL);
+}
+
+long fd_budget_lease(fd_budget_t *budget, long min, long want) {
+    if (min > budget->total) {
+        min = budget->total;
+    }
+    if (want < min) {
+        want = min;
+    }
+    pthread_mutex_lock(&budget->lock);
+    while (budget->available < min) {
+        pthread_cond_wait(&budget->returned, &budget->lock);
+    }
+    long leased = want < budget->available ? want : budget->available;
+    budget->available -= leased;
+    pthread_mutex_unlock(&budget->lock);
+    return leased;
+}
+
+void fd_budget_return(fd_budget_t *budget, long count) {
+    pthread_mutex_lock(&budget->lock);
+    budget->available += count;
+    pthread_cond_broadcast(&budget->returned);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void fd_budget_free(fd_budget_t *budget) {
+    pthread_mutex_destroy(&budget->lock);
+    pthread_cond_destroy(&budget->returned);
+}
+
+int fd_cache_init(fd_cache_t *cache, const minitar_allocator_t *allocator, const char **names,
+                  int num_files, int flags, int capacity) {
+    cache->allocator = allocator;
+    cache->names = names;
+    cache->num_files = num_files;
+    cache->flags = flags;
+    cache->clock = 0;
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->num_open = 0;
+    cache->fds = allocator->malloc_fn(allocator->arg, num_files * sizeof(int));
+    cache->last_used = allocator->malloc_fn(allocator->arg, num_files * sizeof(uint64_t));
+    if (cache->fds == NULL || cache->last_used == NULL) {
+        allocator->free_fn(allocator->arg, cache->fds);
+        allocator->free_fn(allocator->arg, cache->last_used);
+        cache->fds = NULL;
+        cache->last_used = NULL;
+        cache->num_files = 0;
+        return -1;
+    }
+    for (int i = 0; i < num_files; i++) {
+        cache->fds[i] = -1;
+    }
+    return 0;
+}
+
+/*
+ * Close the least recently used open descriptor
+ */
+void fd_cache_evict(fd_cache_t *cache) {
+    int victim = -1;
+    for (int i = 0; i < cache->num_files; i++) {
+        if (cache->fds[i] != -1 &&
+            (victim == -1 || cache->last_used[i] < cache->last_used[victim])) {
+            victim = i;
+        }
+    }
+    if (victim != -1) {
+        close(cache->fds[victim]);
+        cache->fds[victim] = -1;
+        cache->num_open--;
+    }
+}
+
+int fd_cache_get(fd_cache_t *cache, int index) {
+    cache->last_used[index] = ++cache->clock;
+    if (cache->fds[index] != -1) {
+        return cache->fds[index];
+    }
+    if (cache->num_open >= cache->capacity) {
+        fd_cache_evict(cache);
+    }
+    int fd;
+    // Descriptors opened elsewhere can still exhaust the process limit, make
+    // room at our own expense rather than fail
+    while ((fd = open(cache->names[index], cache->flags)) == -1 &&
+           (errno == EMFILE || errno == ENFILE) && cache->num_open > 0) {
+        fd_cache_evict(cache);
+    }
+    if (fd != -1) {
+        cache->fds[index] = fd;
+        cache->num_open++;
+    }
+    return fd;
+}
+
+void fd_cache_free(fd_cache_t *cache) {
+    for (int i = 0; i < cache->num_files; i++) {
+        if (cache->fds[i] != -1) {
+            close(cache->fds[i]);
+        }
+    }
+    cache->allocator->free_fn(cache->allocator->arg, cache->fds);
+    cache->allocator->free_fn(cache->allocator->arg, cache->last_used);
+    cache->fds = NULL;
+    cache->last_used = NULL;
+    cache->num_open = 0;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _FD_BUDGET_H
+#define _FD_BUDGET_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Descriptors left out of every budget for stdio, the archive being written,
+// its sidecar and manifest and other one-off opens
+#define FD_BUDGET_RESERVE 32
+
+// The file descriptors an operation may hold open at once, split into leases
+// for the parts that open many of them (worker threads, merge inputs) so
+// together they stay within RLIMIT_NOFILE instead of failing with EMFILE.
+typedef struct {
+    long total;
+    long available;    // Not leased out
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+} fd_budget_t;
+
+// Size 'budget' from RLIMIT_NOFILE, after raising the soft limit to the hard
+// limit where that is allowed
+void fd_budget_init(fd_budget_t *budget);
+
+// Lease between 'min' and 'want' descriptors (as many as are available),
+// waiting for others to return theirs while fewer than 'min' are (so a 'min'
+// of 0 never waits). A 'min' larger than the whole budget is lowered to it.
+// Returns the number of descriptors leased
+long fd_budget_lease(fd_budget_t *budget, long min, long want);
+
+// Hand back 'count' leased descriptors
+void fd_budget_return(fd_budget_t *budget, long count);
+
+void fd_budget_free(fd_budget_t *budget);
+
+// Descriptors for a fixed set of files, of which at most 'capacity' are open
+// at a time. Opening one more closes the least recently used, and so does
+// running into EMFILE/ENFILE anyway.
+typedef struct {
+    const minitar_allocator_t *allocator;
+    const char **names;
+    int num_files;
+    int flags;              // open(2) flags
+    int *fds;               // Per file, -1 while closed
+    uint64_t *last_used;    // Per file, value of 'clock' at its last use
+    uint64_t clock;
+    int capacity;
+    int num_open;
+} fd_cache_t;
+
+// Prepare a cache for the 'num_files' files in 'names' (which must outlive
+// it), opened with 'flags', keeping at most 'capacity' (at least 1) open
+// Returns 0 on success or -1 if memory could not be allocated
+int fd_cache_init(fd_cache_t *cache, const minitar_allocator_t *allocator, const char **names,
+                  int num_files, int flags, int capacity);
+
+// Descriptor of file 'index', opened if it isn't already. It stays valid
+// until the next call.
+// Returns -1 (with errno set) if the file can't be opened
+int fd_cache_get(fd_cache_t *cache, int index);
+
+// Close every descriptor and release the cache
+void fd_cache_free(fd_cache_t *cache);
+
+#endif    // _FD_BUDGET_H
@@ -2,70 +2,229 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "file_list.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define INITIAL_CAP 4096
+// A varint holding a 64-bit value takes at most this many bytes
+#define MAX_VARINT_LEN 10
 
 void file_list_init(file_list_t *list) {
-    list->head = NULL;
+    file_list_init_with(list, &minitar_default_allocator);
+}
+
+void file_list_init_with(file_list_t *list, const minitar_allocator_t *allocator) {
+    list->allocator = allocator;
+    list->data = NULL;
+    list->len = 0;
+    list->cap = 0;
     list->size = 0;
+    list->spill_fd = -1;
+    list->last = NULL;
+    list->last_len = 0;
+    list->front_coded = 0;
+    list->spill_threshold = FILE_LIST_DEFAULT_SPILL_THRESHOLD;
 }
 
-int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
+/*
+ * Append 'value' to the list's buffer as a little-endian base-128 varint
+ */
+void put_varint(file_list_t *list, uint64_t value) {
+    while (value >= 0x80) {
+        list->data[list->len++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    list->data[list->len++] = (char) value;
+}
+
+/*
+ * Decode the varint at '*pos' in 'data' and move '*pos' past it
+ */
+uint64_t get_varint(const char *data, uint64_t *pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = (unsigned char) data[(*pos)++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+/*
+ * Move the entries into an unlinked temporary file of 'new_cap' bytes and map it
+ * Returns 0 on success or -1 if an error occurs
+ */
+int spill_to_file(file_list_t *list, uint64_t new_cap) {
+    const char *tmp_dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/minitar-list-XXXXXX",
+                 tmp_dir != NULL && tmp_dir[0] != '\0' ? tmp_dir : "/tmp") >= (int) sizeof(path)) {
+        return -1;
+    }
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, new_cap) == 0) {
+        map = mmap(NULL, new_cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    memcpy(map, list->data, list->len);
+    list->allocator->free_fn(list->allocator->arg, list->data);
+    list->data = map;
+    list->cap = new_cap;
+    list->spill_fd = fd;
+    return 0;
+}
+
+/*
+ * Make room for at least 'extra' more bytes of entries
+ * Returns 0 on success or -1 if an error occurs
+ */
+int reserve(file_list_t *list, uint64_t extra) {
+    if (list->cap - list->len >= extra) {
+        return 0;
+    }
+    uint64_t new_cap = list->cap == 0 ? INITIAL_CAP : list->cap;
+    while (new_cap - list->len < extra) {
+        new_cap *= 2;
+    }
+
+    if (list->spill_fd != -1) {
+        if (ftruncate(list->spill_fd, new_cap) != 0) {
+            return -1;
+        }
+        char *map = mmap(NULL, new_cap, PROT_READ | PROT_WRITE, MAP_SHARED, list->spill_fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
         }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
+        munmap(list->data, list->cap);
+        list->data = map;
+        list->cap = new_cap;
         return 0;
     }
+    if (list->spill_threshold != 0 && new_cap > list->spill_threshold) {
+        return spill_to_file(list, new_cap);
+    }
 
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+    const minitar_allocator_t *allocator = list->allocator;
+    char *new_data = allocator->realloc_fn(allocator->arg, list->data, new_cap);
+    if (new_data == NULL) {
+        return -1;
     }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+    list->data = new_data;
+    list->cap = new_cap;
+    return 0;
+}
+
+int file_list_add(file_list_t *list, const char *file_name) {
+    size_t name_len = strlen(file_name);
+    if (name_len >= FILE_LIST_MAX_NAME_LEN) {
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
+    if (list->front_coded && list->last == NULL) {
+        list->last = list->allocator->malloc_fn(list->allocator->arg, FILE_LIST_MAX_NAME_LEN);
+        if (list->last == NULL) {
+            return 1;
+        }
+    }
+    if (reserve(list, 2 * MAX_VARINT_LEN + name_len + 1) != 0) {
+        return 1;
+    }
+
+    if (list->front_coded) {
+        size_t shared = 0;
+        while (shared < list->last_len && shared < name_len &&
+               list->last[shared] == file_name[shared]) {
+            shared++;
+        }
+        put_varint(list, shared);
+        put_varint(list, name_len - shared);
+        memcpy(list->data + list->len, file_name + shared, name_len - shared);
+        list->len += name_len - shared;
+        memcpy(list->last + shared, file_name + shared, name_len - shared);
+        list->last_len = name_len;
+    } else {
+        put_varint(list, name_len);
+        memcpy(list->data + list->len, file_name, name_len + 1);
+        list->len += name_len + 1;
+    }
     list->size++;
     return 0;
 }
 
+const char *file_list_first(const file_list_t *list, file_list_iter_t *iter) {
+    iter->list = list;
+    iter->pos = 0;
+    return file_list_next(iter);
+}
+
+const char *file_list_next(file_list_iter_t *iter) {
+    const file_list_t *list = iter->list;
+    if (iter->pos >= list->len) {
+        return NULL;
+    }
+    if (!list->front_coded) {
+        uint64_t name_len = get_varint(list->data, &iter->pos);
+        const char *name = list->data + iter->pos;
+        iter->pos += name_len + 1;
+        return name;
+    }
+    // The shared prefix is still in place from the previous entry
+    uint64_t shared = get_varint(list->data, &iter->pos);
+    uint64_t suffix_len = get_varint(list->data, &iter->pos);
+    memcpy(iter->name + shared, list->data + iter->pos, suffix_len);
+    iter->name[shared + suffix_len] = '\0';
+    iter->pos += suffix_len;
+    return iter->name;
+}
+
 int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
+    file_list_iter_t iter;
+    for (const char *name = file_list_first(list, &iter); name != NULL;
+         name = file_list_next(&iter)) {
+        if (strcmp(name, file_name) == 0) {
             return 1;
         }
-        current = current->next;
     }
     return 0;
 }
 
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
     // This approach is not particularly efficient
-    node_t *current = l1->head;
-    while (current != NULL) {
-        if (!file_list_contains(l2, current->name)) {
+    file_list_iter_t iter;
+    for (const char *name = file_list_first(l1, &iter); name != NULL;
+         name = file_list_next(&iter)) {
+        if (!file_list_contains(l2, name)) {
             return 0;
         }
-        current = current->next;
     }
     return 1;
 }
 
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        node_t *to_free = current;
-        current = current->next;
-        free(to_free);
+    const minitar_allocator_t *allocator = list->allocator;
+    if (list->spill_fd != -1) {
+        munmap(list->data, list->cap);
+        close(list->spill_fd);
+    } else {
+        allocator->free_fn(allocator->arg, list->data);
     }
-    list->head = NULL;
-    list->size = 0;
+    allocator->free_fn(allocator->arg, list->last);
+
+    int front_coded = list->front_coded;
+    uint64_t spill_threshold = list->spill_threshold;
+    file_list_init_with(list, allocator);
+    list->front_coded = front_coded;
+    list->spill_threshold = spill_threshold;
 }
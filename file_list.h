@@ -3,30 +3,70 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
 
-#define MAX_NAME_LEN 32
+#include <limits.h>
+#include <stdint.h>
 
-//  Definition of each node in the linked list
-typedef struct node {
-    char name[MAX_NAME_LEN];
-    struct node *next;
-} node_t;
+#include "arena.h"
 
-// Linked list definition
+// Longest name a list can hold, including the terminator
+#define FILE_LIST_MAX_NAME_LEN PATH_MAX
+// Lists whose packed entries outgrow this many bytes move them to a
+// memory-mapped temporary file unless told otherwise
+#define FILE_LIST_DEFAULT_SPILL_THRESHOLD (256ULL * 1024 * 1024)
+
+// List of names, kept in insertion order.
+// Entries are packed back to back in one buffer: a varint length followed by
+// the name and its terminator, so a short name costs a few bytes more than
+// its own length. With 'front_coded' set, each entry instead stores how many
+// leading bytes it shares with the previous one and only the rest, which
+// shrinks sorted path lists considerably. Once the buffer would grow past
+// 'spill_threshold' bytes it is moved to an unlinked temporary file (in
+// $TMPDIR, or /tmp) and memory-mapped, leaving paging to the kernel.
 typedef struct {
-    node_t *head;
-    int size;
+    const minitar_allocator_t *allocator;
+    char *data;           // Packed entries
+    uint64_t len;         // Bytes of 'data' in use
+    uint64_t cap;         // Bytes of 'data' allocated or mapped
+    uint64_t size;        // Number of entries
+    int spill_fd;         // Temporary file backing 'data', or -1 while in memory
+    char *last;           // Copy of the latest entry when front coding
+    size_t last_len;
+    // Settings, only to be changed while the list is empty
+    int front_coded;
+    uint64_t spill_threshold;    // 0 = never spill
 } file_list_t;
 
+// Position in a list while walking it with file_list_first/file_list_next
+typedef struct {
+    const file_list_t *list;
+    uint64_t pos;
+    char name[FILE_LIST_MAX_NAME_LEN];    // Rebuilt entry of a front-coded list
+} file_list_iter_t;
+
 // Initialize a new, empty list
 void file_list_init(file_list_t *list);
 
-// Add a new file name to the tail of the linked list
-// Returns 0 on success or 1 if an error occurs
+// Same as file_list_init, but memory comes from 'allocator', which must outlive the list
+void file_list_init_with(file_list_t *list, const minitar_allocator_t *allocator);
+
+// Add a new file name to the tail of the list
+// Returns 0 on success or 1 if an error occurs (including a name of
+// FILE_LIST_MAX_NAME_LEN bytes or more)
 int file_list_add(file_list_t *list, const char *file_name);
 
-// Remove all entries from the list and free any memory associated with them
+// Remove all entries from the list and free any memory associated with them.
+// The settings are kept, so the list can be filled again.
 void file_list_clear(file_list_t *list);
 
+// Start walking 'list' in insertion order
+// Returns the first name, or NULL if the list is empty. Names returned by
+// file_list_first and file_list_next stay valid until the iterator moves on
+// or the list is modified.
+const char *file_list_first(const file_list_t *list, file_list_iter_t *iter);
+
+// Returns the next name, or NULL once every entry has been seen
+const char *file_list_next(file_list_iter_t *iter);
+
 // Determine if a file name is contained in a list
 // Returns 1 if the name is present as an element in the list, 0 otherwise
 int file_list_contains(const file_list_t *list, const char *file_name);
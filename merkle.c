@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "merkle.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+// Sidecar layout (integers little-endian):
+//   magic[8] | chunk_size u32 | reserved u32 | archive_len u64 | num_leaves u64
+//   | root[32] | leaves[num_leaves][32]
+#define SIDECAR_MAGIC "MTMRKL01"
+#define SIDECAR_HEADER_LEN 64
+
+// Domain separation bytes so a leaf can never be confused with an inner node
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+void put_le(uint8_t *dst, uint64_t value, int num_bytes) {
+    for (int i = 0; i < num_bytes; i++) {
+        dst[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+uint64_t get_le(const uint8_t *src, int num_bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < num_bytes; i++) {
+        value |= (uint64_t) src[i] << (8 * i);
+    }
+    return value;
+}
+
+int merkle_sidecar_name(const char *archive_name, char *buf, size_t buf_len) {
+    int n = snprintf(buf, buf_len, "%s%s", archive_name, MERKLE_SUFFIX);
+    return (n < 0 || (size_t) n >= buf_len) ? -1 : 0;
+}
+
+/*
+ * Start hashing a leaf, including the leaf domain prefix
+ */
+void merkle_leaf_init(sha256_ctx_t *ctx) {
+    uint8_t prefix = LEAF_PREFIX;
+    sha256_init(ctx);
+    sha256_update(ctx, &prefix, 1);
+}
+
+void merkle_leaf_hash(const void *chunk, size_t len, merkle_hash_t leaf) {
+    sha256_ctx_t ctx;
+    merkle_leaf_init(&ctx);
+    sha256_update(&ctx, chunk, len);
+    sha256_final(&ctx, leaf);
+}
+
+/*
+ * Hash two sibling nodes into their parent
+ */
+void merkle_node_hash(const merkle_hash_t left, const merkle_hash_t right, merkle_hash_t parent) {
+    uint8_t prefix = NODE_PREFIX;
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, sizeof(merkle_hash_t));
+    sha256_update(&ctx, right, sizeof(merkle_hash_t));
+    sha256_final(&ctx, parent);
+}
+
+/*
+ * Reduce one level of the tree into the next, in place.
+ * A node without a sibling is carried up unchanged.
+ * Returns the number of nodes in the new level
+ */
+size_t merkle_reduce_level(merkle_hash_t *nodes, size_t count) {
+    size_t parents = 0;
+    for (size_t i = 0; i < count; i += 2) {
+        if (i + 1 < count) {
+            merkle_node_hash(nodes[i], nodes[i + 1], nodes[parents]);
+        } else {
+            memmove(nodes[parents], nodes[i], sizeof(merkle_hash_t));
+        }
+        parents++;
+    }
+    return parents;
+}
+
+int merkle_root(minitar_ctx_t *ctx, const merkle_hash_t *leaves, size_t num_leaves,
+                merkle_hash_t root) {
+    if (num_leaves == 0) {
+        sha256(NULL, 0, root);
+        return 0;
+    }
+    merkle_hash_t *level = minitar_malloc(ctx, num_leaves * sizeof(merkle_hash_t));
+    if (level == NULL) {
+        minitar_perror(ctx, "Failed to allocate Merkle tree level");
+        return -1;
+    }
+    memcpy(level, leaves, num_leaves * sizeof(merkle_hash_t));
+    size_t count = num_leaves;
+    while (count > 1) {
+        count = merkle_reduce_level(level, count);
+    }
+    memcpy(root, level[0], sizeof(merkle_hash_t));
+    minitar_free(ctx, level);
+    return 0;
+}
+
+int merkle_push_leaf(merkle_builder_t *builder, const merkle_hash_t leaf) {
+    minitar_ctx_t *ctx = builder->ctx;
+    if (builder->num_leaves == builder->leaves_cap) {
+        size_t new_cap = builder->leaves_cap == 0 ? 64 : builder->leaves_cap * 2;
+        merkle_hash_t *new_leaves =
+            minitar_realloc(ctx, builder->leaves, new_cap * sizeof(merkle_hash_t));
+        if (new_leaves == NULL) {
+            minitar_perror(ctx, "Failed to allocate Merkle leaves");
+            return -1;
+        }
+        builder->leaves = new_leaves;
+        builder->leaves_cap = new_cap;
+    }
+    memcpy(builder->leaves[builder->num_leaves++], leaf, sizeof(merkle_hash_t));
+    return 0;
+}
+
+/*
+ * Start a fresh chunk hash, including the leaf domain prefix
+ */
+void merkle_start_chunk(merkle_builder_t *builder) {
+    merkle_leaf_init(&builder->chunk_ctx);
+    builder->chunk_fill = 0;
+}
+
+void merkle_builder_init(merkle_builder_t *builder, minitar_ctx_t *ctx, size_t chunk_size) {
+    builder->ctx = ctx;
+    builder->chunk_size = chunk_size;
+    builder->total_len = 0;
+    builder->leaves = NULL;
+    builder->num_leaves = 0;
+    builder->leaves_cap = 0;
+    merkle_start_chunk(builder);
+}
+
+int merkle_builder_update(merkle_builder_t *builder, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    while (len > 0) {
+        size_t take = builder->chunk_size - builder->chunk_fill;
+        if (take > len) {
+            take = len;
+        }
+        sha256_update(&builder->chunk_ctx, bytes, take);
+        builder->chunk_fill += take;
+        builder->total_len += take;
+        bytes += take;
+        len -= take;
+
+        if (builder->chunk_fill == builder->chunk_size) {
+            merkle_hash_t leaf;
+            sha256_final(&builder->chunk_ctx, leaf);
+            if (merkle_push_leaf(builder, leaf) != 0) {
+                return -1;
+            }
+            merkle_start_chunk(builder);
+        }
+    }
+    return 0;
+}
+
+int merkle_builder_resume(merkle_builder_t *builder, minitar_ctx_t *ctx, const char *sidecar_name,
+                          int archive_fd, uint64_t archive_len) {
+    merkle_builder_init(builder, ctx, MERKLE_CHUNK_SIZE);
+
+    // Reuse every stored leaf whose chunk lies entirely within the kept prefix
+    uint64_t reused_len = 0;
+    merkle_tree_t old;
+    if (merkle_load(ctx, sidecar_name, &old) == 0) {
+        if (old.chunk_size == builder->chunk_size && old.archive_len >= archive_len) {
+            size_t whole_chunks = archive_len / builder->chunk_size;
+            for (size_t i = 0; i < whole_chunks && i < old.num_leaves; i++) {
+                if (merkle_push_leaf(builder, old.leaves[i]) != 0) {
+                    merkle_free(&old);
+                    return -1;
+                }
+            }
+            reused_len = (uint64_t) builder->num_leaves * builder->chunk_size;
+        }
+        merkle_free(&old);
+    }
+    builder->total_len = reused_len;
+
+    // Whatever is left (at most one chunk with a usable sidecar) is re-read
+    buf_pool_t *pool = minitar_buffers(ctx);
+    uint8_t *buf = pool == NULL ? NULL : buf_pool_get(pool);
+    if (buf == NULL) {
+        minitar_perror(ctx, "Failed to allocate Merkle chunk buffer");
+        return -1;
+    }
+    uint64_t offset = reused_len;
+    int ret = 0;
+    while (offset < archive_len) {
+        size_t want = pool->buffer_size;
+        if (archive_len - offset < want) {
+            want = archive_len - offset;
+        }
+        ssize_t got = pread(archive_fd, buf, want, offset);
+        if (got <= 0) {
+            minitar_perror(ctx, "Failed to read archive for Merkle tree");
+            ret = -1;
+            break;
+        }
+        if (merkle_builder_update(builder, buf, got) != 0) {
+            ret = -1;
+            break;
+        }
+        offset += got;
+    }
+    buf_pool_put(pool, buf);
+    return ret;
+}
+
+int merkle_builder_save(merkle_builder_t *builder, const char *sidecar_name) {
+    minitar_ctx_t *ctx = builder->ctx;
+    if (builder->chunk_fill > 0) {
+        merkle_hash_t leaf;
+        sha256_final(&builder->chunk_ctx, leaf);
+        if (merkle_push_leaf(builder, leaf) != 0) {
+            return -1;
+        }
+        merkle_start_chunk(builder);
+    }
+
+    uint8_t header[SIDECAR_HEADER_LEN] = {0};
+    memcpy(header, SIDECAR_MAGIC, 8);
+    put_le(header + 8, builder->chunk_size, 4);
+    put_le(header + 16, builder->total_len, 8);
+    put_le(header + 24, builder->num_leaves, 8);
+    if (merkle_root(ctx, builder->leaves, builder->num_leaves, header + 32) != 0) {
+        return -1;
+    }
+
+    // Write to a temporary name first so a crash never leaves a torn sidecar
+    char tmp_name[4096];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", sidecar_name) >= (int) sizeof(tmp_name)) {
+        minitar_error(ctx, "Merkle sidecar name too long: %s", sidecar_name);
+        return -1;
+    }
+    FILE *sidecar = fopen(tmp_name, "wb");
+    if (!sidecar) {
+        minitar_perror(ctx, "Failed to open Merkle sidecar %s", sidecar_name);
+        return -1;
+    }
+    if (fwrite(header, sizeof(header), 1, sidecar) != 1 ||
+        (builder->num_leaves > 0 &&
+         fwrite(builder->leaves, sizeof(merkle_hash_t), builder->num_leaves, sidecar) !=
+             builder->num_leaves)) {
+        minitar_perror(ctx, "Failed to write Merkle sidecar %s", sidecar_name);
+        fclose(sidecar);
+        unlink(tmp_name);
+        return -1;
+    }
+    if (fclose(sidecar) != 0 || rename(tmp_name, sidecar_name) != 0) {
+        minitar_perror(ctx, "Failed to save Merkle sidecar %s", sidecar_name);
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+void merkle_builder_free(merkle_builder_t *builder) {
+    minitar_free(builder->ctx, builder->leaves);
+    builder->leaves = NULL;
+    builder->num_leaves = 0;
+    builder->leaves_cap = 0;
+}
+
+int merkle_load(minitar_ctx_t *ctx, const char *sidecar_name, merkle_tree_t *tree) {
+    tree->ctx = ctx;
+    tree->leaves = NULL;
+    FILE *sidecar = fopen(sidecar_name, "rb");
+    if (!sidecar) {
+        return -1;
+    }
+
+    uint8_t header[SIDECAR_HEADER_LEN];
+    if (fread(header, sizeof(header), 1, sidecar) != 1 ||
+        memcmp(header, SIDECAR_MAGIC, 8) != 0) {
+        fclose(sidecar);
+        return -1;
+    }
+    tree->chunk_size = get_le(header + 8, 4);
+    tree->archive_len = get_le(header + 16, 8);
+    tree->num_leaves = get_le(header + 24, 8);
+    memcpy(tree->root, header + 32, sizeof(merkle_hash_t));
+
+    // Reject headers that don't describe the archive length they claim
+    if (tree->chunk_size == 0 ||
+        tree->num_leaves != (tree->archive_len + tree->chunk_size - 1) / tree->chunk_size) {
+        fclose(sidecar);
+        return -1;
+    }
+
+    if (tree->num_leaves > 0) {
+        tree->leaves = minitar_malloc(ctx, tree->num_leaves * sizeof(merkle_hash_t));
+        if (tree->leaves == NULL ||
+            fread(tree->leaves, sizeof(merkle_hash_t), tree->num_leaves, sidecar) !=
+                tree->num_leaves) {
+            minitar_free(ctx, tree->leaves);
+            tree->leaves = NULL;
+            fclose(sidecar);
+            return -1;
+        }
+    }
+    fclose(sidecar);
+    return 0;
+}
+
+void merkle_free(merkle_tree_t *tree) {
+    minitar_free(tree->ctx, tree->leaves);
+    tree->leaves = NULL;
+    tree->num_leaves = 0;
+}
+
+typedef struct {
+    buf_pool_t *pool;           // Chunks are read through these buffers
+    const merkle_tree_t *tree;
+    int archive_fd;
+    size_t first;
+    merkle_hash_t *computed;    // Recomputed leaves for chunks first..last
+    int failed;                 // Set if any chunk could not be read or hashed
+} verify_job_t;
+
+void merkle_verify_chunk(size_t index, int worker, void *arg) {
+    verify_job_t *job = arg;
+    const merkle_tree_t *tree = job->tree;
+    size_t chunk = job->first + index;
+
+    // A buffer may be smaller than a chunk, which is then hashed piece by piece
+    uint8_t *buf = buf_pool_get(job->pool);
+    if (buf == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t offset = (uint64_t) chunk * tree->chunk_size;
+    uint64_t end = offset + tree->chunk_size;
+    if (end > tree->archive_len) {
+        end = tree->archive_len;
+    }
+    sha256_ctx_t leaf_ctx;
+    merkle_leaf_init(&leaf_ctx);
+    while (offset < end) {
+        size_t want = job->pool->buffer_size;
+        if (end - offset < want) {
+            want = end - offset;
+        }
+        ssize_t got = pread(job->archive_fd, buf, want, offset);
+        if (got <= 0) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            buf_pool_put(job->pool, buf);
+            return;
+        }
+        sha256_update(&leaf_ctx, buf, got);
+        offset += got;
+    }
+    buf_pool_put(job->pool, buf);
+    sha256_final(&leaf_ctx, job->computed[index]);
+}
+
+int merkle_verify_range(minitar_ctx_t *ctx, const merkle_tree_t *tree, int archive_fd,
+                        size_t first, size_t last) {
+    int num_jobs = ctx->opts.num_jobs;
+    if (first > last || last >= tree->num_leaves) {
+        minitar_error(ctx, "Merkle chunk range %zu-%zu is outside the tree", first, last);
+        return -1;
+    }
+
+    size_t count = last - first + 1;
+    verify_job_t job = {minitar_buffers(ctx), tree, archive_fd, first, NULL, 0};
+    job.computed = minitar_malloc(ctx, count * sizeof(merkle_hash_t));
+    if (job.pool == NULL || job.computed == NULL) {
+        minitar_perror(ctx, "Failed to allocate Merkle verification state");
+        minitar_free(ctx, job.computed);
+        return -1;
+    }
+
+    // Each worker holds one buffer at a time, so the pool's limit caps how
+    // many chunks are in flight
+    int ret = parallel_for_placed(&ctx->opts.placement, num_jobs, count, merkle_verify_chunk, &job);
+    if (ret != 0 || job.failed) {
+        minitar_error(ctx, "Failed to read archive chunks for verification");
+        minitar_free(ctx, job.computed);
+        return -1;
+    }
+
+    ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(job.computed[i], tree->leaves[first + i], sizeof(merkle_hash_t)) != 0) {
+            minitar_error(ctx, "Chunk %zu (bytes %llu-%llu) does not match its Merkle leaf",
+                    first + i, (unsigned long long) (first + i) * tree->chunk_size,
+                    (unsigned long long) (first + i + 1) * tree->chunk_size - 1);
+            ret = -1;
+        }
+    }
+
+    // Walk the recomputed range up to the root. Nodes inside the range come
+    // from the recomputed hashes, everything else (the authentication path)
+    // from the stored tree, which is itself reduced level by level alongside.
+    merkle_hash_t *stored = minitar_malloc(ctx, tree->num_leaves * sizeof(merkle_hash_t));
+    if (stored == NULL) {
+        minitar_perror(ctx, "Failed to allocate Merkle verification state");
+        minitar_free(ctx, job.computed);
+        return -1;
+    }
+    memcpy(stored, tree->leaves, tree->num_leaves * sizeof(merkle_hash_t));
+    merkle_hash_t *range = job.computed;
+    size_t width = tree->num_leaves;
+    size_t lo = first;
+    size_t hi = last;
+    while (width > 1) {
+        for (size_t parent = lo / 2; parent <= hi / 2; parent++) {
+            size_t left = 2 * parent;
+            size_t right = left + 1;
+            const uint8_t *left_hash = (left >= lo) ? range[left - lo] : stored[left];
+            if (right >= width) {
+                memmove(range[parent - lo / 2], left_hash, sizeof(merkle_hash_t));
+                continue;
+            }
+            const uint8_t *right_hash = (right <= hi) ? range[right - lo] : stored[right];
+            merkle_node_hash(left_hash, right_hash, range[parent - lo / 2]);
+        }
+        width = merkle_reduce_level(stored, width);
+        lo /= 2;
+        hi /= 2;
+    }
+
+    if (memcmp(stored[0], tree->root, sizeof(merkle_hash_t)) != 0) {
+        minitar_error(ctx, "Stored Merkle leaves do not match the stored root");
+        ret = -1;
+    } else if (memcmp(range[0], tree->root, sizeof(merkle_hash_t)) != 0) {
+        minitar_error(ctx, "Recomputed Merkle path does not lead to the stored root");
+        ret = -1;
+    }
+    minitar_free(ctx, stored);
+    minitar_free(ctx, job.computed);
+    return ret;
+}
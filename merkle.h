@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _MERKLE_H
+#define _MERKLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "minitar_ctx.h"
+#include "sha256.h"
+
+// Archives are split into chunks of this many bytes, one Merkle leaf per chunk
+#define MERKLE_CHUNK_SIZE (1 << 20)
+// The tree for archive "foo.tar" is stored in the sidecar file "foo.tar.merkle"
+#define MERKLE_SUFFIX ".merkle"
+
+typedef uint8_t merkle_hash_t[SHA256_DIGEST_LEN];
+
+// Incrementally builds the leaf hashes of an archive as its bytes are written
+typedef struct {
+    minitar_ctx_t *ctx;        // Receives any error
+    size_t chunk_size;
+    sha256_ctx_t chunk_ctx;    // Running hash of the current, incomplete chunk
+    size_t chunk_fill;         // Number of bytes already fed into 'chunk_ctx'
+    uint64_t total_len;        // Number of archive bytes seen so far
+    merkle_hash_t *leaves;
+    size_t num_leaves;
+    size_t leaves_cap;
+} merkle_builder_t;
+
+// A Merkle tree loaded back from a sidecar file
+typedef struct {
+    minitar_ctx_t *ctx;        // Allocates the leaves
+    size_t chunk_size;
+    uint64_t archive_len;
+    merkle_hash_t root;
+    merkle_hash_t *leaves;
+    size_t num_leaves;
+} merkle_tree_t;
+
+// Build the sidecar file name for 'archive_name' into 'buf'
+// Returns 0 on success or -1 if the name does not fit in 'buf_len' bytes
+int merkle_sidecar_name(const char *archive_name, char *buf, size_t buf_len);
+
+// Start a tree for a brand new archive, reporting errors through 'ctx'
+void merkle_builder_init(merkle_builder_t *builder, minitar_ctx_t *ctx, size_t chunk_size);
+
+// Start a tree for an archive whose first 'archive_len' bytes are being kept
+// (e.g. before an append). Leaves for whole chunks are reused from the sidecar
+// 'sidecar_name' when it is usable; only the bytes that are not covered by a
+// reusable leaf are re-read from 'archive_fd'.
+// Returns 0 on success or -1 if an error occurs
+int merkle_builder_resume(merkle_builder_t *builder, minitar_ctx_t *ctx, const char *sidecar_name,
+                          int archive_fd, uint64_t archive_len);
+
+// Hash the next 'len' bytes written to the archive
+// Returns 0 on success or -1 if an error occurs
+int merkle_builder_update(merkle_builder_t *builder, const void *data, size_t len);
+
+// Close off the final partial chunk and write the tree to 'sidecar_name'
+// Returns 0 on success or -1 if an error occurs
+int merkle_builder_save(merkle_builder_t *builder, const char *sidecar_name);
+
+// Release all memory held by 'builder'
+void merkle_builder_free(merkle_builder_t *builder);
+
+// Load the tree stored in 'sidecar_name', allocating through 'ctx'
+// Returns 0 on success or -1 if the file is missing or malformed
+int merkle_load(minitar_ctx_t *ctx, const char *sidecar_name, merkle_tree_t *tree);
+
+// Release all memory held by 'tree'
+void merkle_free(merkle_tree_t *tree);
+
+// Hash one chunk of archive data into a leaf
+void merkle_leaf_hash(const void *chunk, size_t len, merkle_hash_t leaf);
+
+// Compute the root of the tree over 'num_leaves' leaves, reporting errors through 'ctx'
+// Returns 0 on success or -1 if an error occurs
+int merkle_root(minitar_ctx_t *ctx, const merkle_hash_t *leaves, size_t num_leaves,
+                merkle_hash_t root);
+
+// Re-hash chunks 'first' through 'last' (inclusive) of the archive open as
+// 'archive_fd' using up to ctx->opts.num_jobs threads. Each recomputed leaf must match
+// the stored one, and the recomputed leaves must lead to the stored root
+// through their authentication path.
+// Returns 0 if the range is intact or -1 on mismatch or error
+int merkle_verify_range(minitar_ctx_t *ctx, const merkle_tree_t *tree, int archive_fd,
+                        size_t first, size_t last);
+
+#endif    // _MERKLE_H
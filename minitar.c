@@ -1,28 +1,73 @@
+// copy_file_range
+#define _GNU_SOURCE
 #include "minitar.h"
 
+#include <errno.h>
 #include <fcntl.h>
-#include <grp.h>
-#include <math.h>
-#include <pwd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "arena.h"
+#include "merkle.h"
+#include "name_map.h"
+#include "ordered_queue.h"
+#include "out_buf.h"
+#include "parallel.h"
+#include "sha256.h"
+#include "tar_number.h"
+
 #define NUM_TRAILING_BLOCKS 2
-#define MAX_MSG_LEN 128
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define CHECKPOINT_MAGIC "minitar checkpoint 1"
 #define BLOCK_SIZE 512
+// Other tar implementations pad archives to a multiple of this
+#define TAR_RECORD_SIZE (20 * BLOCK_SIZE)
+// Regular files of at most this many bytes are archived in batches of up to
+// SMALL_BATCH_MEMBERS, read with one read each and written with one writev
+#define SMALL_FILE_SIZE (8 * 1024)
+#define SMALL_BATCH_MEMBERS 64
+// Descriptors a shard builder keeps open: its archive, a source file and a
+// checkpoint or manifest
+#define SHARD_BUILDER_FDS 3
 
 // Constants for tar compatibility information
 #define MAGIC "ustar"
+// Magic and version of GNU tar's own format, which spans both fields
+#define GNU_MAGIC "ustar  "
 
 // Constants to represent different file types
-// We'll only use regular files in this project
 #define REGTYPE '0'
+#define SYMTYPE '2'
+#define CHRTYPE '3'
+#define BLKTYPE '4'
 #define DIRTYPE '5'
+#define FIFOTYPE '6'
+#define CONTTYPE '7'
+// Extension headers describing the member after them: PAX records for it
+// (or for every later member) and GNU long names, link targets and labels
+#define XHDTYPE 'x'
+#define XGLTYPE 'g'
+#define GNUTYPE_LONGNAME 'L'
+#define GNUTYPE_LONGLINK 'K'
+#define GNUTYPE_VOLHDR 'V'
+// GNU member whose content holds only the data regions of a sparse file
+#define GNUTYPE_SPARSE 'S'
+// Extension headers larger than this are taken as corrupt
+#define EXTENSION_MAX_SIZE (16 * 1024 * 1024)
+
+// Metadata fill_tar_header_from uses, which is all that is asked of statx
+#define HEADER_STATX_MASK \
+    (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME)
 
 /*
  * Helper function to compute the checksum of a tar header block
@@ -41,368 +86,3598 @@ void compute_checksum(tar_header *header) {
 }
 
 /*
- * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * Get the fields in 'mask' for 'file_name' (relative to 'dir_fd', or of
+ * 'dir_fd' itself if the name is "") into 'stx'. A symlink is described
+ * itself unless opts.dereference is set. Only the fields asked for have to
+ * be fetched, and with opts.no_sync_stat set network and FUSE filesystems
+ * may answer from cached attributes instead of revalidating them.
+ * Returns 0 on success or -1 (with errno set) if an error occurs
+ */
+int minitar_statx(minitar_ctx_t *ctx, int dir_fd, const char *file_name, unsigned mask,
+                  struct statx *stx) {
+    int flags = file_name[0] == '\0' ? AT_EMPTY_PATH : 0;
+    if (!ctx->opts.dereference) {
+        flags |= AT_SYMLINK_NOFOLLOW;
+    }
+    if (ctx->opts.no_sync_stat) {
+        flags |= AT_STATX_DONT_SYNC;
+    }
+    return statx(dir_fd, file_name, flags, mask, stx);
+}
+
+/*
+ * Populates a tar header block pointed to by 'header' with the metadata in
+ * 'stx' (at least HEADER_STATX_MASK) of the file identified by 'file_name'.
+ * Symlinks, directories, FIFOs and devices get entries of their own type,
+ * which carry no payload.
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+int fill_tar_header_from(minitar_ctx_t *ctx, tar_header *header, const char *file_name,
+                         const struct statx *stx) {
     memset(header, 0, sizeof(tar_header));
-    char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
+    if (strlen(file_name) >= sizeof(header->name)) {
+        minitar_error(ctx, "File name too long to archive: %s", file_name);
         return -1;
     }
 
+    unsigned long long size = 0;
+    if (S_ISREG(stx->stx_mode)) {
+        header->typeflag = REGTYPE;
+        size = stx->stx_size;
+    } else if (S_ISLNK(stx->stx_mode)) {
+        header->typeflag = SYMTYPE;
+        char target[PATH_MAX];
+        ssize_t len = readlink(file_name, target, sizeof(target));
+        if (len == -1) {
+            minitar_perror(ctx, "Failed to read symlink %s", file_name);
+            return -1;
+        }
+        if (len > sizeof(header->linkname)) {
+            minitar_error(ctx, "Symlink target too long to archive: %s", file_name);
+            return -1;
+        }
+        memcpy(header->linkname, target, len);    // Terminated unless it fills the field
+    } else if (S_ISDIR(stx->stx_mode)) {
+        header->typeflag = DIRTYPE;
+    } else if (S_ISCHR(stx->stx_mode)) {
+        header->typeflag = CHRTYPE;
+    } else if (S_ISBLK(stx->stx_mode)) {
+        header->typeflag = BLKTYPE;
+    } else if (S_ISFIFO(stx->stx_mode)) {
+        header->typeflag = FIFOTYPE;
+    } else {
+        minitar_error(ctx, "Can't archive socket %s", file_name);
+        return -1;
+    }
     strncpy(header->name, file_name, 100);    // Name of the file, null-terminated string
     snprintf(header->mode, 8, "%07o",
-             stat_buf.st_mode & 07777);    // Permissions for file, 0-padded octal
+             stx->stx_mode & 07777);    // Permissions for file, 0-padded octal
 
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid);    // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid);       // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
+    snprintf(header->uid, 8, "%07o", stx->stx_uid);    // Owner ID of the file, 0-padded octal
+    // Look up name corresponding to owner ID
+    if (minitar_user_name(ctx, stx->stx_uid, header->uname) != 0) {
+        minitar_perror(ctx, "Failed to look up owner name of file %s", file_name);
         return -1;
     }
-    strncpy(header->uname, pwd->pw_name, 32);    // Owner name of the file, null-terminated string
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid);    // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid);        // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
+    snprintf(header->gid, 8, "%07o", stx->stx_gid);    // Group ID of the file, 0-padded octal
+    // Look up name corresponding to group ID
+    if (minitar_group_name(ctx, stx->stx_gid, header->gname) != 0) {
+        minitar_perror(ctx, "Failed to look up group name of file %s", file_name);
         return -1;
     }
-    strncpy(header->gname, grp->gr_name, 32);    // Group name of the file, null-terminated string
 
-    snprintf(header->size, 12, "%011o",
-             (unsigned) stat_buf.st_size);    // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o",
-             (unsigned) stat_buf.st_mtime);    // Modification time, 0-padded octal
-    header->typeflag = REGTYPE;                // File type, always regular file in this project
+    // File size and modification time, 0-padded octal or base 256 from 8 GiB
+    // and the year 2242 on. Times before 1970 don't fit either.
+    if (stx->stx_mtime.tv_sec < 0) {
+        minitar_error(ctx, "Modification time out of range for archive: %s", file_name);
+        return -1;
+    }
+    tar_number_format(header->size, sizeof(header->size), size);
+    tar_number_format(header->mtime, sizeof(header->mtime), stx->stx_mtime.tv_sec);
     strncpy(header->magic, MAGIC, 6);          // Special, standardized sequence of bytes
     memcpy(header->version, "00", 2);          // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o",
-             major(stat_buf.st_dev));    // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o",
-             minor(stat_buf.st_dev));    // Minor device number, 0-padded octal
+    // Major and minor device number, 0-padded octal: the device itself for
+    // device entries, otherwise the one holding the file
+    int is_device = header->typeflag == CHRTYPE || header->typeflag == BLKTYPE;
+    snprintf(header->devmajor, 8, "%07o", is_device ? stx->stx_rdev_major : stx->stx_dev_major);
+    snprintf(header->devminor, 8, "%07o", is_device ? stx->stx_rdev_minor : stx->stx_dev_minor);
 
     compute_checksum(header);
     return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio), which we'll learn about later
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name'.
+ * Returns 0 on success or -1 if an error occurs
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
-    char err_msg[MAX_MSG_LEN];
-
-    struct stat stat_buf;
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
+int fill_tar_header(minitar_ctx_t *ctx, tar_header *header, const char *file_name) {
+    struct statx stx;
+    // statx is a system call to inspect file metadata
+    if (minitar_statx(ctx, AT_FDCWD, file_name, HEADER_STATX_MASK, &stx) != 0) {
+        minitar_perror(ctx, "Failed to stat file %s", file_name);
         return -1;
     }
+    return fill_tar_header_from(ctx, header, file_name, &stx);
+}
 
-    off_t file_size = stat_buf.st_size;
-    if (nbytes > file_size) {
-        file_size = 0;
-    } else {
-        file_size -= nbytes;
-    }
+/*
+ * Open the regular file 'file_name' to archive its contents. Unless
+ * opts.dereference is set, a symlink swapped in since the file was stat'ed
+ * is refused instead of followed, and O_NONBLOCK keeps a FIFO swapped in
+ * from hanging the open.
+ * Returns the file descriptor, or -1 (with errno set) if an error occurs
+ */
+int open_source_file(minitar_ctx_t *ctx, const char *file_name) {
+    return openat(AT_FDCWD, file_name,
+                  O_RDONLY | O_NONBLOCK | (ctx->opts.dereference ? 0 : O_NOFOLLOW));
+}
+
+// Destination of an archive write. Every byte that lands in the archive goes
+// through archive_write so optional digests see exactly what was written.
+typedef struct {
+    FILE *archive;
+    merkle_builder_t *merkle;    // NULL unless a Merkle tree is being maintained
+    off_t offset;                // Archive length so far, where the next write lands
+} archive_writer_t;
 
-    if (truncate(file_name, file_size) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
-        perror(err_msg);
+/*
+ * Write 'nbytes' bytes from 'buf' to the archive behind 'writer'
+ * Returns 0 upon success, -1 upon error
+ */
+int archive_write(archive_writer_t *writer, const void *buf, size_t nbytes) {
+    if (fwrite(buf, 1, nbytes, writer->archive) != nbytes) {
+        return -1;
+    }
+    if (writer->merkle != NULL && merkle_builder_update(writer->merkle, buf, nbytes) != 0) {
         return -1;
     }
+    writer->offset += nbytes;
     return 0;
 }
 
-
-
-
-
-int write_files_to_archive(const char *archive_name, const file_list_t *files, const int create) {
-    char err_msg[MAX_MSG_LEN];
-
-    // either creates/overwrites or appends
-    char procedure[3];
-    if (create) {
-        strncpy(procedure, "wb", 3);
-    } else {
-        strncpy(procedure, "ab", 3);
+/*
+ * Write the 'iovcnt' buffers in 'iov' to the archive behind 'writer' in one
+ * system call where possible. 'iov' is used up in the process.
+ * Returns 0 upon success, -1 upon error
+ */
+int archive_writev(archive_writer_t *writer, struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (writer->merkle != NULL &&
+            merkle_builder_update(writer->merkle, iov[i].iov_base, iov[i].iov_len) != 0) {
+            return -1;
+        }
+        writer->offset += iov[i].iov_len;
     }
-
-    // open archive
-    FILE *archive = fopen(archive_name, procedure);
-    if (!archive) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive file: %s", archive_name);
-        perror(err_msg);
+    // Whatever stdio still buffers has to land first
+    if (fflush(writer->archive) != 0) {
         return -1;
     }
-
-    node_t *curr = files->head;
-    while (curr != NULL) {
-        // opens file
-        FILE *src = fopen(curr->name, "rb");
-        if (!src) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open source file: %s", curr->name);
-            perror(err_msg);
-            fclose(archive);
+    int fd = fileno(writer->archive);
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
             return -1;
         }
-
-        // gets file size
-        if (fseek(src, 0, SEEK_END) != 0) {
-            perror("Failed to seek to end of file");
-            fclose(src);
-            fclose(archive);
-            return -1;
+        // Skip over what a short write did get through
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-        long file_size = ftell(src);
-        if (file_size == -1) {
-            perror("Failed to get file size");
-            fclose(src);
-            fclose(archive);
-            return -1;
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
         }
-        fseek(src, 0, SEEK_SET);
+    }
+    return 0;
+}
 
-        // Create header
-        tar_header *header = malloc(sizeof(tar_header));
-        if (!header) {
-            perror("Failed to allocate memory for header");
-            fclose(src);
-            fclose(archive);
-            return -1;
-        }
+/*
+ * Write one sha256sum-format line for 'file_name' to 'manifest'.
+ * Like sha256sum, names containing a backslash or newline are escaped and the
+ * line is prefixed with a backslash.
+ * Returns 0 upon success, -1 upon error
+ */
+int write_manifest_entry(FILE *manifest, const uint8_t digest[SHA256_DIGEST_LEN],
+                         const char *file_name) {
+    char hex[SHA256_HEX_LEN];
+    sha256_to_hex(digest, hex);
 
-        if (fill_tar_header(header, curr->name) != 0) {
-            free(header);
-            fclose(src);
-            fclose(archive);
-            return -1;
+    int escape = strpbrk(file_name, "\\\n") != NULL;
+    if (fprintf(manifest, "%s%s  ", escape ? "\\" : "", hex) < 0) {
+        return -1;
+    }
+    for (const char *c = file_name; *c != '\0'; c++) {
+        int ret;
+        if (*c == '\\') {
+            ret = fputs("\\\\", manifest);
+        } else if (*c == '\n') {
+            ret = fputs("\\n", manifest);
+        } else {
+            ret = fputc(*c, manifest);
         }
-
-        // Compute checksum
-        compute_checksum(header);
-
-        // Write header
-        if (fwrite(header, sizeof(tar_header), 1, archive) == 0) {
-            perror ("unable to write header to archive file");
+        if (ret == EOF) {
             return -1;
         }
+    }
+    return fputc('\n', manifest) == EOF ? -1 : 0;
+}
 
-        // Write file content
-        char buffer[BLOCK_SIZE];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, BLOCK_SIZE, src)) > 0) {
-            if (fwrite(buffer, 1, bytes_read, archive) == 0) {
-                perror ("unable to write file contents to archive file");
-                return -1;
-            }
-        }
+// Progress of a create, as recorded in its checkpoint file
+typedef struct {
+    long members_done;      // Number of leading list entries fully written
+    off_t archive_len;      // Archive length just after the last of those members
+    off_t manifest_len;     // Manifest length at the same point (0 without a manifest)
+} checkpoint_t;
 
-        // File padding
-        size_t padding_size = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
-        if (padding_size > 0) {
-            char padding[BLOCK_SIZE] = {0};
-            if (fwrite(padding, 1, padding_size, archive) == 0) {
-                perror ("unable to write file padding to archive file");
-                return -1;
-            }
-        }
+/*
+ * Flush 'file' all the way to stable storage
+ * Returns 0 upon success, -1 upon error
+ */
+int sync_file(FILE *file) {
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-        free(header);
-        fclose(src);
-        curr = curr->next;
+/*
+ * Read the checkpoint stored in 'ckpt_name' into 'ckpt'
+ * Returns 1 if a checkpoint was loaded, 0 if there is none, or -1 if it is malformed
+ */
+int load_checkpoint(minitar_ctx_t *ctx, const char *ckpt_name, checkpoint_t *ckpt) {
+    FILE *file = fopen(ckpt_name, "r");
+    if (!file) {
+        return 0;
+    }
+    char magic[sizeof(CHECKPOINT_MAGIC) + 1];
+    long long archive_len, manifest_len;
+    int ok = fgets(magic, sizeof(magic), file) != NULL &&
+             strncmp(magic, CHECKPOINT_MAGIC "\n", sizeof(magic)) == 0 &&
+             fscanf(file, "members %ld\narchive %lld\nmanifest %lld\n", &ckpt->members_done,
+                    &archive_len, &manifest_len) == 3 &&
+             ckpt->members_done >= 0 && archive_len >= 0 && manifest_len >= 0;
+    fclose(file);
+    if (!ok) {
+        minitar_error(ctx, "Malformed checkpoint file %s", ckpt_name);
+        return -1;
     }
+    ckpt->archive_len = archive_len;
+    ckpt->manifest_len = manifest_len;
+    return 1;
+}
 
-    // Write two empty blocks to signify end of archive
-    char empty_block[BLOCK_SIZE] = {0};
-    fwrite(empty_block, 1, sizeof(empty_block), archive);
-    fwrite(empty_block, 1, sizeof(empty_block), archive);
+/*
+ * Durably record that the first 'members_done' members have been written.
+ * The archive and manifest are synced first so the checkpoint never points
+ * past data that could still be lost, then the checkpoint file is replaced
+ * atomically and its directory entry synced.
+ * Returns 0 upon success, -1 upon error
+ */
+int save_checkpoint(minitar_ctx_t *ctx, const char *ckpt_name, FILE *archive, FILE *manifest,
+                    long members_done) {
+    struct stat archive_stat, manifest_stat;
+    if (sync_file(archive) != 0 || fstat(fileno(archive), &archive_stat) != 0 ||
+        (manifest != NULL &&
+         (sync_file(manifest) != 0 || fstat(fileno(manifest), &manifest_stat) != 0))) {
+        minitar_perror(ctx, "Failed to sync archive for checkpoint");
+        return -1;
+    }
 
-    fclose(archive);
+    char tmp_name[PATH_MAX];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", ckpt_name) >= (int) sizeof(tmp_name)) {
+        minitar_error(ctx, "Checkpoint file name too long: %s", ckpt_name);
+        return -1;
+    }
+    FILE *file = fopen(tmp_name, "w");
+    if (!file) {
+        minitar_perror(ctx, "Failed to open checkpoint file %s", ckpt_name);
+        return -1;
+    }
+    fprintf(file, CHECKPOINT_MAGIC "\nmembers %ld\narchive %lld\nmanifest %lld\n", members_done,
+            (long long) archive_stat.st_size,
+            manifest != NULL ? (long long) manifest_stat.st_size : 0LL);
+    if (sync_file(file) != 0) {
+        minitar_perror(ctx, "Failed to write checkpoint file %s", ckpt_name);
+        fclose(file);
+        unlink(tmp_name);
+        return -1;
+    }
+    fclose(file);
+    if (rename(tmp_name, ckpt_name) != 0) {
+        minitar_perror(ctx, "Failed to replace checkpoint file %s", ckpt_name);
+        unlink(tmp_name);
+        return -1;
+    }
 
+    // Make the rename itself durable
+    char dir_name[PATH_MAX];
+    strncpy(dir_name, ckpt_name, sizeof(dir_name) - 1);
+    dir_name[sizeof(dir_name) - 1] = '\0';
+    char *slash = strrchr(dir_name, '/');
+    if (slash == NULL) {
+        strcpy(dir_name, ".");
+    } else if (slash == dir_name) {
+        dir_name[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    int dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
     return 0;
 }
 
-int create_archive(const char *archive_name, const file_list_t *files) {
-    return write_files_to_archive(archive_name, files, 1);
-}
+// Payload buffers each slot of a pipelined create cycles through, so its
+// reader can fill one while the writer drains another
+#define PIPELINE_RING 2
+
+// A member of a pipelined create on its way from its reader to the writer
+typedef struct {
+    char name[FILE_LIST_MAX_NAME_LEN];
+    tar_header header;
+    int failed;                      // No header could be made, the reason is in 'error'
+    char error[MINITAR_ERR_LEN];
+    // Payload chunks, counted over the slot's whole lifetime: chunk n is in
+    // chunks[n % PIPELINE_RING] and chunk_lens[] holds its length, 0 at the
+    // end of the payload or -1 if reading failed (the reason is in 'error')
+    seq_counter_t filled;            // Chunks handed to the writer
+    seq_counter_t drained;           // Chunks the writer is done with
+    char *chunks[PIPELINE_RING];
+    ssize_t chunk_lens[PIPELINE_RING];
+} pipeline_slot_t;
+
+typedef struct pipeline pipeline_t;
+
+// A reader thread of a pipeline, walking the file list on its own iterator
+typedef struct {
+    pipeline_t *pipeline;
+    pthread_t thread;
+    file_list_iter_t iter;
+} pipeline_reader_t;
 
-// int update_archive(const char *archive_name, const file_list_t *files) {
-//     FILE *archive = fopen(archive_name, "rb");
-//     if (!archive) {
-//         perror("Failed to open archive file: %s", archive_name);
-//         return -1;
-//     }
+/*
+ * Lease descriptors from the context's budget for up to 'num_jobs' workers
+ * (0 or less for the default) that each keep 'fds_per_job' open at once.
+ * This never waits: workers left without a lease are dropped, but one always
+ * runs, on the descriptors kept in reserve. The lease, to be returned when
+ * the workers are done, is stored in '*leased'.
+ * Returns the number of workers to run
+ */
+int lease_workers(minitar_ctx_t *ctx, int num_jobs, int fds_per_job, long *leased) {
+    if (num_jobs <= 0) {
+        num_jobs = parallel_default_jobs();
+    }
+    *leased = 0;
+    fd_budget_t *budget = minitar_fd_budget(ctx);
+    if (budget == NULL) {
+        return num_jobs;
+    }
+    long granted = fd_budget_lease(budget, 0, (long) num_jobs * fds_per_job);
+    int workers = (int) (granted / fds_per_job);
+    *leased = (long) workers * fds_per_job;
+    if (granted > *leased) {
+        fd_budget_return(budget, granted - *leased);
+    }
+    return workers > 0 ? workers : 1;
+}
 
-//     file_list_t archive_files;
-//     file_list_init(&archive_files);
+// Reader threads of a pipelined create and the window of members between
+// them and the single writer. Readers take members with an atomic counter
+// and hand them over through an ordered_queue_t, so nothing is locked.
+struct pipeline {
+    minitar_ctx_t *ctx;
+    const file_list_t *files;
+    uint64_t first;                  // List index of sequence number 0
+    uint64_t num_members;
+    uint64_t next_seq;               // Next member for a reader to take
+    ordered_queue_t queue;
+    pipeline_slot_t *slots;          // One per queue slot
+    buf_pool_t *buffers;             // The context's shared pool
+    void **chunks;                   // Every slot's chunks, taken from it at once
+    size_t num_chunks;               // Zero until they are taken
+    pipeline_reader_t *readers;
+    int num_readers;
+    long fds_leased;                 // From the context's descriptor budget
+};
 
-//     get_archive_file_list(archive_name, &archive_files);
+/*
+ * Read up to 'nbytes' bytes from 'fd' into 'buf', stopping short only at end of file
+ * Returns the number of bytes read or -1 upon error
+ */
+ssize_t read_full(int fd, char *buf, size_t nbytes) {
+    size_t total = 0;
+    while (total < nbytes) {
+        ssize_t ret = read(fd, buf + total, nbytes - total);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret == -1) {
+            return -1;
+        } else if (ret == 0) {
+            break;
+        }
+        total += ret;
+    }
+    return total;
+}
 
-//     // compares files from archive and files to update
-//     node_t *archive_file
-//     node_t *update_file = files->head;
-//     while(update_file != NULL) {
-//         if (archive_file) == NULL {
-//             return -1;
-//         } else {
-//             if (archive_file->name != update_file->name) {
-//                 return -1;
-//             }
-//         }
-//         update_file = update_file->next;
-//         archive_file = archive_file->next;
-//     }
-//     return 0;
-// }
+/*
+ * Fill the claimed slot of member 'seq' (named 'name') with its header and
+ * publish it, then stream the payload through the slot's chunks until the
+ * end of the file. Errors are left in the slot for the writer, which reports
+ * them when it gets to the member so they come out in list order.
+ */
+void pipeline_read_member(pipeline_t *pipeline, minitar_ctx_t *ctx, uint64_t seq,
+                          const char *name) {
+    pipeline_slot_t *slot = &pipeline->slots[seq % pipeline->queue.window];
+    minitar_clear_error(ctx);
+    strcpy(slot->name, name);
+    int fd = -1;
+    slot->failed = fill_tar_header(ctx, &slot->header, name) != 0;
+    if (!slot->failed && slot->header.typeflag == REGTYPE) {
+        fd = open_source_file(ctx, name);
+        if (fd == -1) {
+            minitar_perror(ctx, "Failed to open source file: %s", name);
+            slot->failed = 1;
+        }
+    }
+    if (slot->failed) {
+        memcpy(slot->error, ctx->error, sizeof(slot->error));
+    }
+    ordered_queue_publish(&pipeline->queue, seq);
+    if (slot->failed) {
+        return;
+    }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    for (uint32_t chunk = seq_counter_get(&slot->filled);; chunk++) {
+        // Wait until the writer is done with the chunk this one replaces
+        if (seq_counter_wait(&slot->drained, chunk - PIPELINE_RING + 1,
+                             &pipeline->queue.stop) != 0) {
+            break;
+        }
+        // Only regular files have a payload
+        size_t index = chunk % PIPELINE_RING;
+        ssize_t len =
+            fd == -1 ? 0 : read_full(fd, slot->chunks[index], pipeline->buffers->buffer_size);
+        if (len == -1) {
+            minitar_perror(ctx, "Failed to read source file: %s", name);
+            memcpy(slot->error, ctx->error, sizeof(slot->error));
+        }
+        slot->chunk_lens[index] = len;
+        seq_counter_set(&slot->filled, chunk + 1);
+        if (len <= 0) {
+            break;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
 
-    remove_trailing_bytes(archive_name, BLOCK_SIZE * NUM_TRAILING_BLOCKS);
-    return write_files_to_archive(archive_name, files, 0);
+/*
+ * Reader thread of a pipelined create: take members until there are none left
+ * or the pipeline is stopped
+ */
+void *pipeline_read(void *arg) {
+    pipeline_reader_t *reader = arg;
+    pipeline_t *pipeline = reader->pipeline;
+    minitar_ctx_t ctx;
+    minitar_ctx_init_child(&ctx, pipeline->ctx);
+    // Errors travel with their member instead
+    ctx.on_error = NULL;
+    parallel_place_worker(&ctx.opts.placement, (int) (reader - pipeline->readers));
+
+    const char *name = file_list_first(pipeline->files, &reader->iter);
+    uint64_t pos = 0;    // List index of 'name'
+    for (;;) {
+        uint64_t seq = __atomic_fetch_add(&pipeline->next_seq, 1, __ATOMIC_RELAXED);
+        if (seq >= pipeline->num_members) {
+            break;
+        }
+        for (; pos < pipeline->first + seq; pos++) {
+            name = file_list_next(&reader->iter);
+        }
+        if (ordered_queue_claim(&pipeline->queue, seq) != 0) {
+            break;
+        }
+        pipeline_read_member(pipeline, &ctx, seq, name);
+    }
+    minitar_ctx_free(&ctx);
+    return NULL;
 }
 
+/*
+ * Stop the readers of 'pipeline', wait for them to exit and release it
+ */
+void pipeline_finish(pipeline_t *pipeline) {
+    if (pipeline->queue.stages != NULL) {
+        ordered_queue_stop(&pipeline->queue);
+        for (size_t i = 0; i < pipeline->queue.window; i++) {
+            seq_counter_interrupt(&pipeline->slots[i].drained);
+        }
+    }
+    for (int i = 0; i < pipeline->num_readers; i++) {
+        pthread_join(pipeline->readers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < pipeline->num_chunks; i++) {
+        buf_pool_put(pipeline->buffers, pipeline->chunks[i]);
+    }
+    if (pipeline->queue.stages != NULL) {
+        ordered_queue_free(&pipeline->queue, &pipeline->ctx->allocator);
+    }
+    if (pipeline->fds_leased > 0) {
+        fd_budget_return(pipeline->ctx->fd_budget, pipeline->fds_leased);
+    }
+}
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    FILE *archive = fopen(archive_name, "rb");
-    if (!archive) {
-        perror("Failed to open archive file");
+/*
+ * Start reader threads on list entries 'first' onwards of 'files'. They stay
+ * up to a window of members ahead of the writer, whose chunks all come from
+ * the context's buffer pool, so they count against opts.memory_limit together
+ * with everything else drawing on it (e.g. other shard builders).
+ * Bookkeeping comes from 'arena'.
+ * Returns 0 on success, 1 if the memory limit cannot hold the smallest window
+ * (nothing is started then) or -1 if an error occurs
+ */
+int pipeline_start(minitar_ctx_t *ctx, pipeline_t *pipeline, arena_t *arena,
+                   const file_list_t *files, uint64_t first) {
+    const minitar_opts_t *opts = &ctx->opts;
+    buf_pool_t *pool = minitar_buffers(ctx);
+    if (pool == NULL) {
+        minitar_perror(ctx, "Failed to allocate pipeline buffers");
         return -1;
     }
+    // The queue needs a window of at least two members
+    size_t fits = pool->max_buffers == 0 ? SIZE_MAX : pool->max_buffers / PIPELINE_RING;
+    if (fits < 2) {
+        return 1;
+    }
+    // Each reader has one source file open at a time
+    long fds_leased;
+    int num_jobs = lease_workers(ctx, opts->num_jobs, 1, &fds_leased);
+    // Two members per reader keep each one busy while the writer works
+    // through the member at the head of the window
+    size_t window = 2 * (size_t) num_jobs;
+    window = fits < window ? fits : window;
+
+    pipeline->ctx = ctx;
+    pipeline->files = files;
+    pipeline->first = first;
+    pipeline->num_members = files->size - first;
+    pipeline->next_seq = 0;
+    pipeline->num_readers = 0;
+    pipeline->fds_leased = fds_leased;
+    pipeline->queue.stages = NULL;
+    pipeline->buffers = pool;
+    pipeline->num_chunks = 0;
+    if (ordered_queue_init(&pipeline->queue, &ctx->allocator, window) != 0) {
+        minitar_perror(ctx, "Failed to allocate pipeline");
+        pipeline_finish(pipeline);
+        return -1;
+    }
+    window = pipeline->queue.window;
+    pipeline->slots = arena_alloc(arena, window * sizeof(pipeline_slot_t));
+    pipeline->readers = arena_alloc(arena, num_jobs * sizeof(pipeline_reader_t));
+    pipeline->chunks = arena_alloc(arena, window * PIPELINE_RING * sizeof(void *));
+    if (pipeline->slots == NULL || pipeline->readers == NULL || pipeline->chunks == NULL) {
+        minitar_perror(ctx, "Failed to allocate pipeline");
+        ordered_queue_free(&pipeline->queue, &ctx->allocator);
+        pipeline->queue.stages = NULL;
+        pipeline_finish(pipeline);
+        return -1;
+    }
+    // All at once, waiting for other users of the pool to return enough
+    if (buf_pool_get_many(pool, pipeline->chunks, window * PIPELINE_RING) != 0) {
+        minitar_perror(ctx, "Failed to allocate pipeline buffers");
+        pipeline_finish(pipeline);
+        return -1;
+    }
+    pipeline->num_chunks = window * PIPELINE_RING;
+    for (size_t i = 0; i < window; i++) {
+        seq_counter_init(&pipeline->slots[i].filled, 0);
+        seq_counter_init(&pipeline->slots[i].drained, 0);
+        for (int j = 0; j < PIPELINE_RING; j++) {
+            pipeline->slots[i].chunks[j] = pipeline->chunks[i * PIPELINE_RING + j];
+        }
+    }
 
-    tar_header *header = malloc(sizeof(tar_header));
-    char block[BLOCK_SIZE] = {0};
-
-    int read_status = 1;
-    int file_size;
-    int num_blocks;
-
-    while (read_status == 1) {
-        read_status = fread(header, sizeof(tar_header), 1, archive);
+    for (int i = 0; i < num_jobs; i++) {
+        pipeline_reader_t *reader = &pipeline->readers[i];
+        reader->pipeline = pipeline;
+        if (pthread_create(&reader->thread, NULL, pipeline_read, reader) != 0) {
+            break;
+        }
+        pipeline->num_readers++;
+    }
+    if (pipeline->num_readers == 0) {
+        minitar_error(ctx, "Failed to start pipeline reader threads");
+        pipeline_finish(pipeline);
+        return -1;
+    }
+    return 0;
+}
 
-        // check if the block is all zeros (possible first footer block)
-        if ((int)memcmp(header, block, BLOCK_SIZE) == 0) {
-            // read the next block to confirm it's also all zeros
-            read_status = fread(header, sizeof(tar_header), 1, archive);
-            if (read_status != 1) {
-                perror("unable to read given archive file, footers may not be correctly formatted");
-                free(header);
-                fclose(archive);
-                return -1;
-            }
+// Where write_files_to_archive takes members from: opened and read in place
+// one after the other, or handed over in list order by a pipeline's readers
+typedef struct {
+    minitar_ctx_t *ctx;
+    pipeline_t *pipeline;        // NULL when reading in place
+    // Reading in place
+    file_list_iter_t *iter;
+    const char *next_name;
+    struct statx next_stx;       // Metadata of 'next_name' if 'next_stated' is set
+    int next_stated;
+    FILE *file;                  // NULL for members without a payload
+    char *buffer;
+    size_t buffer_size;
+    // Pipelined
+    uint64_t seq;                // Sequence number of the current member
+    pipeline_slot_t *slot;       // Its slot while it is open
+    uint32_t chunk;              // Next chunk to take from the slot
+} member_source_t;
 
-            if (read_status == 1 && (int)memcmp(header, block, BLOCK_SIZE) == 0) {
-                free(header);
-                fclose(archive);
-                return 0;
+/*
+ * Open the next member of 'source', filling in its header and name
+ * Returns 0 upon success, -1 upon error
+ */
+int member_open(member_source_t *source, tar_header *header, const char **name) {
+    minitar_ctx_t *ctx = source->ctx;
+    pipeline_t *pipeline = source->pipeline;
+    if (pipeline == NULL) {
+        *name = source->next_name;
+        int ret = source->next_stated
+                      ? fill_tar_header_from(ctx, header, *name, &source->next_stx)
+                      : fill_tar_header(ctx, header, *name);
+        source->next_stated = 0;
+        // Links and special files have no payload to open
+        if (ret != 0 || header->typeflag != REGTYPE) {
+            return ret;
+        }
+        int fd = open_source_file(ctx, *name);
+        source->file = fd == -1 ? NULL : fdopen(fd, "rb");
+        if (!source->file) {
+            minitar_perror(ctx, "Failed to open source file: %s", *name);
+            if (fd != -1) {
+                close(fd);
             }
-            // if it's not a second zero block, print error
-            perror("unexpected all zero block found in tar file");
-            free(header);
-            fclose(archive);
             return -1;
         }
+        return 0;
+    }
 
-        // add the filename to the list
-        file_list_add(files, header->name);
-
-        // convert file size from octal to long int for usability
-        file_size = strtol(header->size, NULL, 8);
-
-        // determine number of 512 blocks of content that follow after this header
-        num_blocks = (int)ceil((double)file_size / BLOCK_SIZE);
-
-        fseek(archive, num_blocks * BLOCK_SIZE, SEEK_CUR);
+    if (ordered_queue_wait(&pipeline->queue, source->seq) != 0) {
+        minitar_error(ctx, "Pipeline stopped");
+        return -1;
     }
-    free(header);
-    fclose(archive);
-    return -1;
+    source->slot = &pipeline->slots[source->seq % pipeline->queue.window];
+    source->chunk = seq_counter_get(&source->slot->drained);
+    if (source->slot->failed) {
+        minitar_error(ctx, "%s", source->slot->error);
+        return -1;
+    }
+    memcpy(header, &source->slot->header, sizeof(tar_header));
+    *name = source->slot->name;
+    return 0;
 }
 
-int extract_files_from_archive(const char *archive_name) {
-//     printf("Extracting files from archive: %s\n", archive_name);
-
-//     // Open the archive file in read-binary mode
-//     FILE *archive = fopen(archive_name, "rb");
-//     if (!archive) {
-//         perror("Failed to open archive file");
-//         return -1;
-//     }
+/*
+ * Point '*data' at the next piece of the open member's payload, which stays
+ * valid until the next call
+ * Returns its length, 0 at the end of the payload or -1 upon error
+ */
+ssize_t member_read(member_source_t *source, const char **data) {
+    minitar_ctx_t *ctx = source->ctx;
+    if (source->pipeline == NULL) {
+        if (source->file == NULL) {
+            return 0;
+        }
+        size_t nbytes = fread(source->buffer, 1, source->buffer_size, source->file);
+        if (nbytes == 0 && ferror(source->file)) {
+            minitar_perror(ctx, "Failed to read source file: %s", source->next_name);
+            return -1;
+        }
+        *data = source->buffer;
+        return nbytes;
+    }
 
-//     tar_header header;
-//     char buffer[BLOCK_SIZE];
-//     size_t bytes_read;
+    // Whatever the previous call returned has been written, so its buffer can be refilled
+    pipeline_slot_t *slot = source->slot;
+    seq_counter_set(&slot->drained, source->chunk);
+    seq_counter_wait(&slot->filled, source->chunk + 1, NULL);
+    size_t index = source->chunk % PIPELINE_RING;
+    source->chunk++;
+    if (slot->chunk_lens[index] == -1) {
+        minitar_error(ctx, "%s", slot->error);
+        return -1;
+    }
+    *data = slot->chunks[index];
+    return slot->chunk_lens[index];
+}
 
-//     while (1) {
-//         // Read the header block
-//         bytes_read = fread(&header, sizeof(tar_header), 1, archive);
-//         if (bytes_read != 1) {
-//             if (feof(archive)) {
-//                 break; // End of archive
-//             }
-//             perror("Failed to read header from archive");
-//             fclose(archive);
-//             return -1;
-//         }
+/*
+ * Finish the open member of 'source' and move on to the next one
+ */
+void member_close(member_source_t *source) {
+    if (source->pipeline == NULL) {
+        if (source->file != NULL) {
+            fclose(source->file);
+            source->file = NULL;
+        }
+        source->next_name = file_list_next(source->iter);
+        return;
+    }
+    seq_counter_set(&source->slot->drained, source->chunk);
+    ordered_queue_release(&source->pipeline->queue, source->seq);
+    source->slot = NULL;
+    source->seq++;
+}
 
-//         // Check if the header block is empty (end of archive)
-//         if (header.name[0] == '\0') {
-//             break;
-//         }
+/*
+ * Release whatever 'source' still holds, stopping its pipeline if it has one
+ */
+void member_source_free(member_source_t *source) {
+    if (source->file != NULL) {
+        fclose(source->file);
+        source->file = NULL;
+    }
+    if (source->pipeline != NULL) {
+        pipeline_finish(source->pipeline);
+        source->pipeline = NULL;
+    }
+}
 
-//         // Convert file size from octal string to integer
-//         size_t file_size = strtol(header.size, NULL, 8);
+/*
+ * Write the next member of 'source' to the archive behind 'writer', with
+ * 'header' as scratch space, and its digest to 'manifest' unless it is NULL
+ * '*nbytes' receives the number of archive bytes the member took up
+ * Returns 0 upon success, -1 upon error
+ */
+int write_member(minitar_ctx_t *ctx, member_source_t *source, archive_writer_t *writer,
+                 tar_header *header, FILE *manifest, long long *nbytes) {
+    // Opens the file and creates its header
+    const char *name;
+    if (member_open(source, header, &name) != 0) {
+        return -1;
+    }
 
-//         // Print the file name and size for debugging
-//         printf("Extracting file: %s (size: %zu bytes)\n", header.name, file_size);
+    // Write header
+    if (archive_write(writer, header, sizeof(tar_header)) != 0) {
+        minitar_perror(ctx, "unable to write header to archive file");
+        return -1;
+    }
 
-//         // Open the output file for writing
-//         FILE *output_file = fopen(header.name, "wb");
-//         if (!output_file) {
-//             fprintf(stderr, "Failed to create file %s: %s\n", header.name, strerror(errno));
-//             fclose(archive);
+    // Write file content
+    const char *data;
+    ssize_t bytes_read;
+    long long file_size = 0;
+    sha256_ctx_t digest_ctx;
+    sha256_init(&digest_ctx);
+    while ((bytes_read = member_read(source, &data)) > 0) {
+        if (archive_write(writer, data, bytes_read) != 0) {
+            minitar_perror(ctx, "unable to write file contents to archive file");
+            return -1;
+        }
+        if (manifest != NULL) {
+            sha256_update(&digest_ctx, data, bytes_read);
+        }
+        file_size += bytes_read;
+    }
+    if (bytes_read == -1) {
+        return -1;
+    }
+
+    // Only regular files have contents a checksum can be verified against
+    if (manifest != NULL && header->typeflag == REGTYPE) {
+        uint8_t digest[SHA256_DIGEST_LEN];
+        sha256_final(&digest_ctx, digest);
+        if (write_manifest_entry(manifest, digest, name) != 0) {
+            minitar_perror(ctx, "unable to write manifest entry");
+            return -1;
+        }
+    }
+
+    // File padding
+    size_t padding_size = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
+    if (padding_size > 0) {
+        char padding[BLOCK_SIZE] = {0};
+        if (archive_write(writer, padding, padding_size) != 0) {
+            minitar_perror(ctx, "unable to write file padding to archive file");
+            return -1;
+        }
+    }
+
+    member_close(source);
+    *nbytes = BLOCK_SIZE + file_size + padding_size;
+    return 0;
+}
+
+// Headers and write list of a batch of small members
+typedef struct {
+    tar_header headers[SMALL_BATCH_MEMBERS];
+    struct iovec iov[2 * SMALL_BATCH_MEMBERS];
+} small_batch_t;
+
+/*
+ * Write the run of small regular files at the front of 'source' (which reads
+ * in place) as one batch: each is stat'ed, opened, read with a single read
+ * into the source's buffer and closed, then all headers and padded payloads
+ * go out in one writev. Saves the per-member stdio calls of write_member.
+ * The batch ends before the first member that isn't a small regular file
+ * (its metadata is left in the source for write_member) and after 'max_members' members or
+ * 'max_bytes' archive bytes (0 = no limit).
+ * '*num_members' and '*nbytes' receive what was written, which is nothing if
+ * the next member isn't small.
+ * Returns 0 upon success, -1 upon error
+ */
+int write_small_batch(minitar_ctx_t *ctx, member_source_t *source, archive_writer_t *writer,
+                      small_batch_t *batch, FILE *manifest, long max_members, long long max_bytes,
+                      long *num_members, long long *nbytes) {
+    int count = 0;
+    int iovcnt = 0;
+    size_t staged = 0;
+    long long total = 0;
+    while (source->next_name != NULL && count < SMALL_BATCH_MEMBERS &&
+           (max_members == 0 || count < max_members) && (max_bytes == 0 || total < max_bytes)) {
+        const char *name = source->next_name;
+        struct statx *stx = &source->next_stx;
+        if (minitar_statx(ctx, AT_FDCWD, name, HEADER_STATX_MASK, stx) != 0) {
+            // write_member reports it
+            break;
+        }
+        size_t padded = (stx->stx_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        // One byte past the size tells whether the file grew since it was stat'ed
+        if (!S_ISREG(stx->stx_mode) || stx->stx_size > SMALL_FILE_SIZE ||
+            staged + padded + 1 > source->buffer_size) {
+            source->next_stated = 1;
+            break;
+        }
+        int fd = open_source_file(ctx, name);
+        if (fd == -1) {
+            break;
+        }
+        char *payload = source->buffer + staged;
+        ssize_t len = read_full(fd, payload, stx->stx_size + 1);
+        close(fd);
+        if (len != stx->stx_size) {
+            // Changed while being read, or unreadable: write_member copies
+            // whatever is there or reports the error
+            break;
+        }
+        memset(payload + len, 0, padded - len);
+
+        tar_header *header = &batch->headers[count];
+        if (fill_tar_header_from(ctx, header, name, stx) != 0) {
+            return -1;
+        }
+        if (manifest != NULL) {
+            uint8_t digest[SHA256_DIGEST_LEN];
+            sha256(payload, len, digest);
+            if (write_manifest_entry(manifest, digest, name) != 0) {
+                minitar_perror(ctx, "unable to write manifest entry");
+                return -1;
+            }
+        }
+        batch->iov[iovcnt].iov_base = header;
+        batch->iov[iovcnt++].iov_len = sizeof(tar_header);
+        batch->iov[iovcnt].iov_base = payload;
+        batch->iov[iovcnt++].iov_len = padded;
+        staged += padded;
+        total += BLOCK_SIZE + padded;
+        count++;
+        source->next_name = file_list_next(source->iter);
+    }
+
+    if (count > 0 && archive_writev(writer, batch->iov, iovcnt) != 0) {
+        minitar_perror(ctx, "unable to write files to archive file");
+        return -1;
+    }
+    *num_members = count;
+    *nbytes = total;
+    return 0;
+}
+
+// An embedded index is an ordinary member written just before the trailer,
+// so other tar tools extract it as a text file. Its payload is a header line,
+// one tab-separated line per member (header offset, size, mtime, octal mode,
+// type, name escaped as in list_archive's TSV format), newlines as padding,
+// and a fixed-size locator ending exactly at the last block before the
+// trailer. One read at the end of the archive finds it.
+// The locator is 64 bytes of text: "minitar index locator ", the offset of
+// the index member's header and the number of entries (not the payload
+// size, which the header has), each as 20 zero-padded decimal digits
+// followed by a space and a newline respectively.
+#define INDEX_MEMBER_NAME ".minitar-index"
+#define INDEX_HEADER_LINE "minitar index 1\n"
+#define INDEX_LOCATOR_FORMAT "minitar index locator %020llu %020llu\n"
+#define INDEX_LOCATOR_SIZE 64
+
+int header_checksum_valid(const tar_header *header);
+int decode_header_numbers(const tar_header *header, tar_member_t *member);
+size_t tsv_escape(const char *src, size_t len, char *dst);
+
+/*
+ * Whether 'header' is that of an embedded index, which scans skip
+ */
+int is_index_member(const tar_header *header) {
+    return (header->typeflag == REGTYPE || header->typeflag == '\0') &&
+           strncmp(header->name, INDEX_MEMBER_NAME, sizeof(header->name)) == 0;
+}
+
+/*
+ * Check the locator in 'block', the last block of the members of the archive
+ * open as 'fd' (which end at 'members_end'): it has to point at an index
+ * member whose payload ends right there.
+ * Returns as find_archive_index
+ */
+int check_index_locator(int fd, const char *block, off_t members_end, off_t *offset,
+                        uint64_t *size) {
+    char locator[INDEX_LOCATOR_SIZE + 1];
+    memcpy(locator, block + BLOCK_SIZE - INDEX_LOCATOR_SIZE, INDEX_LOCATOR_SIZE);
+    locator[INDEX_LOCATOR_SIZE] = '\0';
+    unsigned long long index_offset, count;
+    if (sscanf(locator, INDEX_LOCATOR_FORMAT, &index_offset, &count) != 2 ||
+        index_offset % BLOCK_SIZE != 0 || index_offset >= (unsigned long long) members_end) {
+        return 0;
+    }
+
+    tar_header header;
+    if (pread(fd, &header, sizeof(header), index_offset) != sizeof(header)) {
+        return -1;
+    }
+    uint64_t index_size;
+    if (!is_index_member(&header) || !header_checksum_valid(&header) ||
+        tar_number_parse(header.size, sizeof(header.size), &index_size) != 0 ||
+        index_size < INDEX_LOCATOR_SIZE || index_size % BLOCK_SIZE != 0 ||
+        index_offset + BLOCK_SIZE + index_size != (uint64_t) members_end) {
+        return 0;
+    }
+    *offset = index_offset;
+    *size = index_size;
+    return 1;
+}
+
+/*
+ * Find the embedded index of the archive open as 'fd', whose members end at
+ * 'members_end', from the locator in the block before that
+ * Returns 1 with the offset of its header in '*offset' and its payload size
+ * in '*size', 0 if the archive has no index or -1 if it can't be read
+ */
+int find_archive_index(int fd, off_t members_end, off_t *offset, uint64_t *size) {
+    char block[BLOCK_SIZE];
+    if (members_end < 2 * BLOCK_SIZE) {
+        return 0;
+    }
+    if (pread(fd, block, sizeof(block), members_end - BLOCK_SIZE) != sizeof(block)) {
+        return -1;
+    }
+    return check_index_locator(fd, block, members_end, offset, size);
+}
+
+/*
+ * Whether the block at 'block' is all zeros. It is tested a word at a time,
+ * which the compiler turns into vector instructions.
+ */
+int block_is_zero(const char *block) {
+    uint64_t bits = 0;
+    for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(word));
+        bits |= word;
+    }
+    return bits == 0;
+}
+
+/*
+ * Find where the members of the archive open as 'fd', 'archive_len' bytes
+ * long, end and its trailer starts. The trailer is every zero block after the
+ * last member: two from minitar, up to a whole record from tools that pad
+ * archives to TAR_RECORD_SIZE. Walking back over zero blocks from the end
+ * only finds the last non-zero block though: the last member's data may
+ * itself end in zero blocks, and a block that looks like a header near the
+ * end may just as well be member data (say, of a tar file archived whole).
+ * So the end is only taken as found when the embedded index ends there, and
+ * otherwise only a walk over the headers from the start can tell.
+ * The trailer of an indexed archive never runs past its final record, so
+ * that is read once and the locator looked for there.
+ * Returns 1 with the offset in '*end', 0 if the archive has to be walked or
+ * -1 (with errno set) if it can't be read
+ */
+int find_archive_end(int fd, off_t archive_len, off_t *end) {
+    char tail[TAR_RECORD_SIZE];
+    off_t tail_end = archive_len - archive_len % BLOCK_SIZE;
+    off_t tail_start = tail_end > TAR_RECORD_SIZE ? tail_end - TAR_RECORD_SIZE : 0;
+    size_t len = tail_end - tail_start;
+    if (pread(fd, tail, len, tail_start) != (ssize_t) len) {
+        return -1;
+    }
+    size_t num_blocks = len / BLOCK_SIZE;
+    while (num_blocks > 0 && block_is_zero(tail + (num_blocks - 1) * BLOCK_SIZE)) {
+        num_blocks--;
+    }
+    if (num_blocks == 0) {
+        // Nothing but zeros: no members at all if that was the whole archive
+        if (tail_start == 0) {
+            *end = 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    off_t data_end = tail_start + num_blocks * BLOCK_SIZE;
+    off_t index_offset;
+    uint64_t index_size;
+    int found = check_index_locator(fd, tail + (num_blocks - 1) * BLOCK_SIZE, data_end,
+                                    &index_offset, &index_size);
+    if (found == 1) {
+        *end = data_end;
+    }
+    return found;
+}
+
+/*
+ * Read the 'size'-byte payload of the index member whose header is at
+ * 'offset' in the archive open as 'fd', checking that it is in a known format
+ * Returns the payload, null-terminated, for the caller to free with
+ * minitar_free, or NULL if an error occurs
+ */
+char *read_index_payload(minitar_ctx_t *ctx, int fd, off_t offset, uint64_t size) {
+    char *payload = minitar_malloc(ctx, size + 1);
+    if (payload == NULL) {
+        minitar_perror(ctx, "Failed to allocate archive index");
+        return NULL;
+    }
+    if (pread(fd, payload, size, offset + BLOCK_SIZE) != (ssize_t) size) {
+        minitar_perror(ctx, "Failed to read archive index");
+        minitar_free(ctx, payload);
+        return NULL;
+    }
+    payload[size] = '\0';
+    if (strncmp(payload, INDEX_HEADER_LINE, strlen(INDEX_HEADER_LINE)) != 0) {
+        minitar_error(ctx, "Unknown archive index format");
+        minitar_free(ctx, payload);
+        return NULL;
+    }
+    return payload;
+}
+
+// Entries of an index being built, which are collected as members are
+// written (and taken over from any index the archive had before)
+typedef struct {
+    out_buf_t out;    // Payload, collected in memory
+    unsigned long long count;
+    off_t end;        // Where the last member added ends
+    char escaped[2 * sizeof(((tar_header *) NULL)->name)];
+} index_build_t;
+
+/*
+ * Prepare 'index' to collect entries
+ * Returns 0 on success or -1 if an error occurs
+ */
+int index_build_init(minitar_ctx_t *ctx, index_build_t *index) {
+    index->count = 0;
+    index->end = 0;
+    if (out_buf_init(&index->out, -1, &ctx->allocator) != 0 ||
+        out_buf_write(&index->out, INDEX_HEADER_LINE, strlen(INDEX_HEADER_LINE)) != 0) {
+        minitar_perror(ctx, "Failed to allocate archive index");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * scan_archive callback that adds an index entry for each member
+ */
+int add_index_entry(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    index_build_t *index = arg;
+    char fields[128];
+    int fields_len = snprintf(fields, sizeof(fields), "%lld\t%llu\t%lld\t%llo\t%c\t",
+                              (long long) member->header_offset,
+                              (unsigned long long) member->size, member->mtime,
+                              (unsigned long long) member->mode, member->typeflag);
+    int ret = out_buf_write(&index->out, fields, fields_len);
+    // Long names are escaped a piece at a time
+    size_t chunk_len = sizeof(index->escaped) / 2;
+    for (size_t done = 0; done < member->name_len; done += chunk_len) {
+        size_t len = member->name_len - done < chunk_len ? member->name_len - done : chunk_len;
+        size_t escaped_len = tsv_escape(member->name + done, len, index->escaped);
+        ret |= out_buf_write(&index->out, index->escaped, escaped_len);
+    }
+    if (ret != 0 || out_buf_putc(&index->out, '\n') != 0) {
+        minitar_perror(ctx, "Failed to allocate archive index");
+        return -1;
+    }
+    index->count++;
+    index->end = member->payload_offset +
+                 (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Add index entries for 'num_members' members just written from 'headers',
+ * one after the other starting at 'offset'
+ * Returns 0 on success or -1 if an error occurs
+ */
+int index_written_members(minitar_ctx_t *ctx, index_build_t *index, const tar_header *headers,
+                          long num_members, off_t offset) {
+    for (long i = 0; i < num_members; i++) {
+        const tar_header *header = &headers[i];
+        tar_member_t member;
+        if (decode_header_numbers(header, &member) != 0) {
+            minitar_error(ctx, "Malformed header written for %.100s", header->name);
+            return -1;
+        }
+        member.header = header;
+        member.start_offset = offset;
+        member.header_offset = offset;
+        member.payload_offset = offset + BLOCK_SIZE;
+        member.name = header->name;
+        member.name_len = strnlen(header->name, sizeof(header->name));
+        member.typeflag = header->typeflag;
+        if (add_index_entry(ctx, &member, index) != 0) {
+            return -1;
+        }
+        offset = index->end;
+    }
+    return 0;
+}
+
+/*
+ * Take over the entries of the index member at 'offset', 'size' bytes of
+ * payload, in the archive open as 'fd' into 'index'
+ * Returns 0 on success or -1 if an error occurs
+ */
+int index_load_entries(minitar_ctx_t *ctx, index_build_t *index, int fd, off_t offset,
+                       uint64_t size) {
+    char *payload = read_index_payload(ctx, fd, offset, size);
+    if (payload == NULL) {
+        return -1;
+    }
+    // Entries run up to the first blank line of the padding
+    char *entries = payload + strlen(INDEX_HEADER_LINE);
+    char *end = entries;
+    while (*end != '\n' && *end != '\0') {
+        char *line_end = strchr(end, '\n');
+        if (line_end == NULL) {
+            minitar_error(ctx, "Malformed archive index entry");
+            minitar_free(ctx, payload);
+            return -1;
+        }
+        end = line_end + 1;
+        index->count++;
+    }
+    int ret = out_buf_write(&index->out, entries, end - entries);
+    if (ret != 0) {
+        minitar_perror(ctx, "Failed to allocate archive index");
+    }
+    index->end = offset;
+    minitar_free(ctx, payload);
+    return ret;
+}
+
+/*
+ * Add index entries for the members of the archive 'archive_name', which end
+ * at 'end' without a trailer, as after a create is rolled back to its
+ * checkpoint. A trailer is put in place for as long as the scan takes.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int index_partial_archive(minitar_ctx_t *ctx, const char *archive_name, off_t end,
+                          index_build_t *index) {
+    char trailer[NUM_TRAILING_BLOCKS * BLOCK_SIZE] = {0};
+    int fd = open(archive_name, O_WRONLY);
+    if (fd == -1 || pwrite(fd, trailer, sizeof(trailer), end) != sizeof(trailer)) {
+        minitar_perror(ctx, "Failed to write archive file: %s", archive_name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    int ret = scan_archive(ctx, archive_name, add_index_entry, index);
+    if (ftruncate(fd, end) != 0) {
+        minitar_perror(ctx, "Failed to truncate archive file: %s", archive_name);
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+/*
+ * Write the embedded index with the entries collected in 'index' to
+ * 'writer', which has written all of the members but not the trailer yet
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_archive_index(minitar_ctx_t *ctx, const char *archive_name, archive_writer_t *writer,
+                        index_build_t *index) {
+    off_t index_offset = writer->offset;
+
+    // Newlines pad the entries so the locator ends on a block boundary
+    size_t payload_len = index->out.len + INDEX_LOCATOR_SIZE;
+    payload_len = (payload_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char locator[INDEX_LOCATOR_SIZE + 1];
+    snprintf(locator, sizeof(locator), INDEX_LOCATOR_FORMAT, (unsigned long long) index_offset,
+             index->count);
+    while (index->out.len < payload_len - INDEX_LOCATOR_SIZE) {
+        if (out_buf_putc(&index->out, '\n') != 0) {
+            minitar_perror(ctx, "Failed to allocate archive index");
+            return -1;
+        }
+    }
+    if (out_buf_write(&index->out, locator, INDEX_LOCATOR_SIZE) != 0) {
+        minitar_perror(ctx, "Failed to allocate archive index");
+        return -1;
+    }
+
+    // An ordinary file as far as the header goes, owned by whoever wrote it
+    struct statx stx;
+    memset(&stx, 0, sizeof(stx));
+    stx.stx_mode = S_IFREG | 0644;
+    stx.stx_uid = getuid();
+    stx.stx_gid = getgid();
+    stx.stx_size = payload_len;
+    stx.stx_mtime.tv_sec = time(NULL);
+    tar_header header;
+    if (fill_tar_header_from(ctx, &header, INDEX_MEMBER_NAME, &stx) != 0) {
+        return -1;
+    }
+    if (archive_write(writer, &header, sizeof(header)) != 0 ||
+        archive_write(writer, index->out.data, payload_len) != 0) {
+        minitar_perror(ctx, "Failed to write archive index to %s", archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+int write_files_to_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *files,
+                           const int create, index_build_t *index) {
+    const minitar_opts_t *opts = &ctx->opts;
+    // A resumed create throws away whatever was written after the last
+    // checkpoint and from then on behaves like an append to the partial archive
+    char ckpt_name[PATH_MAX];
+    checkpoint_t ckpt = {0, 0, 0};
+    int checkpointing = create && (opts->checkpoint_members > 0 || opts->checkpoint_bytes > 0);
+    int resuming = 0;
+    if (snprintf(ckpt_name, sizeof(ckpt_name), "%s%s", archive_name, CHECKPOINT_SUFFIX) >=
+        (int) sizeof(ckpt_name)) {
+        minitar_error(ctx, "Archive name too long: %s", archive_name);
+        return -1;
+    }
+    if (create && opts->resume) {
+        resuming = load_checkpoint(ctx, ckpt_name, &ckpt);
+        if (resuming < 0) {
+            return -1;
+        }
+        if (resuming && (uint64_t) ckpt.members_done > files->size) {
+            minitar_error(ctx, "Checkpoint %s is past the end of the file list", ckpt_name);
+            return -1;
+        }
+        if (resuming && (truncate(archive_name, ckpt.archive_len) != 0 ||
+                         (opts->manifest_out != NULL &&
+                          truncate(opts->manifest_out, ckpt.manifest_len) != 0))) {
+            minitar_perror(ctx, "Failed to roll back %s to its checkpoint", archive_name);
+            return -1;
+        }
+        // Members written before the checkpoint are only listed in the archive itself
+        if (resuming && index != NULL &&
+            index_partial_archive(ctx, archive_name, ckpt.archive_len, index) != 0) {
+            return -1;
+        }
+    }
+    int appending = !create || resuming;
+    // "-" sends a new archive to standard output, e.g. down a pipe
+    int to_stdout = create && strcmp(archive_name, "-") == 0;
+    if (to_stdout && (opts->merkle || checkpointing || opts->resume || index != NULL)) {
+        minitar_error(ctx,
+                      "Merkle trees, checkpoints and indexes need an archive file, not stdout");
+        return -1;
+    }
+
+    // either creates/overwrites or appends
+    char procedure[3];
+    if (!appending) {
+        strncpy(procedure, "wb", 3);
+    } else {
+        strncpy(procedure, "ab", 3);
+    }
+
+    // open archive
+    FILE *archive = NULL;
+    if (to_stdout) {
+        int fd = dup(STDOUT_FILENO);
+        archive = fd == -1 ? NULL : fdopen(fd, "wb");
+        if (fd != -1 && !archive) {
+            close(fd);
+        }
+    } else {
+        archive = fopen(archive_name, procedure);
+    }
+    if (!archive) {
+        minitar_perror(ctx, "Failed to open archive file: %s", archive_name);
+        return -1;
+    }
+
+    // Appended members start where the archive ends
+    struct stat stat_buf;
+    if (appending && fstat(fileno(archive), &stat_buf) != 0) {
+        minitar_perror(ctx, "Failed to stat archive file: %s", archive_name);
+        fclose(archive);
+        return -1;
+    }
+    archive_writer_t writer = {archive, NULL, appending ? stat_buf.st_size : 0};
+
+    // Appends keep an existing Merkle sidecar current even if not asked to,
+    // otherwise it would no longer describe the archive
+    char sidecar_name[PATH_MAX];
+    merkle_builder_t merkle;
+    if (merkle_sidecar_name(archive_name, sidecar_name, sizeof(sidecar_name)) != 0) {
+        minitar_error(ctx, "Archive name too long: %s", archive_name);
+        fclose(archive);
+        return -1;
+    }
+    if (!appending && !to_stdout) {
+        // A sidecar left over from a previous archive of the same name is stale now
+        unlink(sidecar_name);
+    }
+    if (!appending && opts->merkle) {
+        merkle_builder_init(&merkle, ctx, MERKLE_CHUNK_SIZE);
+        writer.merkle = &merkle;
+    } else if (appending && (opts->merkle || access(sidecar_name, F_OK) == 0)) {
+        merkle_builder_init(&merkle, ctx, MERKLE_CHUNK_SIZE);
+        int read_fd = open(archive_name, O_RDONLY);
+        if (read_fd == -1 ||
+            merkle_builder_resume(&merkle, ctx, sidecar_name, read_fd, stat_buf.st_size) != 0) {
+            minitar_perror(ctx, "Failed to rebuild Merkle tree for %s", archive_name);
+            if (read_fd != -1) {
+                close(read_fd);
+            }
+            merkle_builder_free(&merkle);
+            fclose(archive);
+            return -1;
+        }
+        close(read_fd);
+        writer.merkle = &merkle;
+    }
+
+    // Scratch memory for the whole operation, released in one go at the end
+    arena_t arena;
+    arena_init(&arena, &ctx->allocator);
+    char *buffer = NULL;
+    pipeline_t pipeline;
+    member_source_t source = {ctx, NULL};
+    small_batch_t *batch = NULL;
+
+    // Payload digests are computed from the same buffers that are copied into
+    // the archive, so the manifest costs no extra reads of the source files
+    FILE *manifest = NULL;
+    if (opts->manifest_out != NULL) {
+        manifest = fopen(opts->manifest_out, resuming ? "a" : "w");
+        if (!manifest) {
+            minitar_perror(ctx, "Failed to open manifest file: %s", opts->manifest_out);
+            goto fail;
+        }
+    }
+
+    // One header block serves every member in turn
+    tar_header *header = arena_alloc(&arena, sizeof(tar_header));
+    if (!header) {
+        minitar_perror(ctx, "Failed to allocate memory for header");
+        goto fail;
+    }
+
+    file_list_iter_t *iter = arena_alloc(&arena, sizeof(file_list_iter_t));
+    if (!iter) {
+        minitar_perror(ctx, "Failed to allocate memory for file list");
+        goto fail;
+    }
+    source.iter = iter;
+    source.next_name = file_list_first(files, iter);
+    for (long i = 0; i < ckpt.members_done; i++) {
+        source.next_name = file_list_next(iter);
+    }
+    if (opts->pipeline) {
+        // Readers open and read members ahead while this thread writes them out
+        // in order, unless the memory limit is too tight for that
+        int started = pipeline_start(ctx, &pipeline, &arena, files, ckpt.members_done);
+        if (started == -1) {
+            goto fail;
+        }
+        source.pipeline = started == 0 ? &pipeline : NULL;
+    }
+    if (source.pipeline == NULL) {
+        // Payloads are copied through one pooled buffer, so with a memory limit
+        // concurrent writers (e.g. shard builders) wait their turn for one
+        buf_pool_t *pool = minitar_buffers(ctx);
+        buffer = pool == NULL ? NULL : buf_pool_get(pool);
+        if (!buffer) {
+            minitar_perror(ctx, "Failed to allocate copy buffer");
+            goto fail;
+        }
+        source.buffer = buffer;
+        source.buffer_size = pool->buffer_size;
+        batch = arena_alloc(&arena, sizeof(small_batch_t));
+        if (!batch) {
+            minitar_perror(ctx, "Failed to allocate memory for header");
+            goto fail;
+        }
+    }
+
+    long members_done = ckpt.members_done;
+    long members_since_checkpoint = 0;
+    long long bytes_since_checkpoint = 0;
+    while ((uint64_t) members_done < files->size) {
+        // Small files go out in batches, anything else one at a time. A batch
+        // never runs past the point where the next checkpoint is due.
+        long num_members = 0;
+        long long nbytes = 0;
+        off_t members_offset = writer.offset;
+        const tar_header *written = batch != NULL ? batch->headers : NULL;
+        if (batch != NULL &&
+            write_small_batch(ctx, &source, &writer, batch, manifest,
+                              checkpointing && opts->checkpoint_members > 0
+                                  ? opts->checkpoint_members - members_since_checkpoint
+                                  : 0,
+                              checkpointing && opts->checkpoint_bytes > 0
+                                  ? opts->checkpoint_bytes - bytes_since_checkpoint
+                                  : 0,
+                              &num_members, &nbytes) != 0) {
+            goto fail;
+        }
+        if (num_members == 0) {
+            if (write_member(ctx, &source, &writer, header, manifest, &nbytes) != 0) {
+                goto fail;
+            }
+            num_members = 1;
+            written = header;
+        }
+        if (index != NULL &&
+            index_written_members(ctx, index, written, num_members, members_offset) != 0) {
+            goto fail;
+        }
+
+        members_done += num_members;
+        members_since_checkpoint += num_members;
+        bytes_since_checkpoint += nbytes;
+        if (checkpointing &&
+            ((opts->checkpoint_members > 0 &&
+              members_since_checkpoint >= opts->checkpoint_members) ||
+             (opts->checkpoint_bytes > 0 && bytes_since_checkpoint >= opts->checkpoint_bytes))) {
+            if (save_checkpoint(ctx, ckpt_name, archive, manifest, members_done) != 0) {
+                goto fail;
+            }
+            members_since_checkpoint = 0;
+            bytes_since_checkpoint = 0;
+        }
+    }
+    member_source_free(&source);
+
+    if (index != NULL && write_archive_index(ctx, archive_name, &writer, index) != 0) {
+        goto fail;
+    }
+
+    // Write two empty blocks to signify end of archive
+    char empty_block[BLOCK_SIZE] = {0};
+    for (int i = 0; i < NUM_TRAILING_BLOCKS; i++) {
+        if (archive_write(&writer, empty_block, sizeof(empty_block)) != 0) {
+            minitar_perror(ctx, "unable to write footer to archive file");
+            goto fail;
+        }
+    }
+
+    if (fclose(archive) != 0) {
+        minitar_perror(ctx, "Failed to close archive file: %s", archive_name);
+        archive = NULL;
+        goto fail;
+    }
+    archive = NULL;
+
+    if (manifest != NULL) {
+        int ret = fclose(manifest);
+        manifest = NULL;
+        if (ret != 0) {
+            minitar_perror(ctx, "Failed to close manifest file: %s", opts->manifest_out);
+            goto fail;
+        }
+    }
+
+    // The archive is complete, nothing is left to resume
+    if (checkpointing || resuming) {
+        unlink(ckpt_name);
+    }
+    buf_pool_put(ctx->pool, buffer);
+    arena_free(&arena);
+
+    if (writer.merkle != NULL) {
+        int ret = merkle_builder_save(writer.merkle, sidecar_name);
+        merkle_builder_free(writer.merkle);
+        return ret;
+    }
+    return 0;
+
+fail:
+    member_source_free(&source);
+    if (buffer != NULL) {
+        buf_pool_put(ctx->pool, buffer);
+    }
+    arena_free(&arena);
+    if (manifest != NULL) {
+        fclose(manifest);
+    }
+    if (writer.merkle != NULL) {
+        merkle_builder_free(writer.merkle);
+    }
+    if (archive != NULL) {
+        fclose(archive);
+    }
+    return -1;
+}
+
+int create_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *files) {
+    if (!ctx->opts.embed_index) {
+        return write_files_to_archive(ctx, archive_name, files, 1, NULL);
+    }
+    index_build_t index;
+    if (index_build_init(ctx, &index) != 0) {
+        return -1;
+    }
+    int ret = write_files_to_archive(ctx, archive_name, files, 1, &index);
+    out_buf_free(&index.out);
+    return ret;
+}
+
+// int update_archive(const char *archive_name, const file_list_t *files) {
+//     FILE *archive = fopen(archive_name, "rb");
+//     if (!archive) {
+//         perror("Failed to open archive file: %s", archive_name);
+//         return -1;
+//     }
+
+//     file_list_t archive_files;
+//     file_list_init(&archive_files);
+
+//     get_archive_file_list(archive_name, &archive_files);
+
+//     // compares files from archive and files to update
+//     node_t *archive_file
+//     node_t *update_file = files->head;
+//     while(update_file != NULL) {
+//         if (archive_file) == NULL {
 //             return -1;
-//         }
+//         } else {
+//             if (archive_file->name != update_file->name) {
+//                 return -1;
+//             }
+//         }
+//         update_file = update_file->next;
+//         archive_file = archive_file->next;
+//     }
+//     return 0;
+// }
+
+/*
+ * Build the name of shard number 'shard' of 'archive_name' into 'buf':
+ * "data.tar" becomes "data.3.tar", any other name just gets ".3" appended
+ * Returns 0 on success or -1 if the name does not fit in 'buf_len' bytes
+ */
+int shard_archive_name(const char *archive_name, int shard, char *buf, size_t buf_len) {
+    size_t len = strlen(archive_name);
+    size_t stem_len = len;
+    if (len > 4 && strcmp(archive_name + len - 4, ".tar") == 0) {
+        stem_len = len - 4;
+    }
+    int ret = snprintf(buf, buf_len, "%.*s.%d%s", (int) stem_len, archive_name, shard,
+                       archive_name + stem_len);
+    return ret < 0 || (size_t) ret >= buf_len ? -1 : 0;
+}
+
+// Input file as seen by the shard planner
+typedef struct {
+    const char *name;
+    off_t size;
+    size_t index;    // Position in the input list
+    int shard;
+} shard_input_t;
+
+// Work shared by the threads building shards
+typedef struct {
+    const char *archive_name;
+    file_list_t *shard_files;
+    minitar_ctx_t *ctx;
+    pthread_mutex_t lock;    // Protects 'ctx' while shard errors are merged into it
+    int failed;
+} shard_job_t;
+
+/*
+ * qsort comparator putting the largest inputs first, ties in input order
+ */
+int compare_shard_inputs(const void *a, const void *b) {
+    const shard_input_t *input_a = a, *input_b = b;
+    if (input_a->size != input_b->size) {
+        return input_a->size < input_b->size ? 1 : -1;
+    }
+    return input_a->index < input_b->index ? -1 : input_a->index > input_b->index;
+}
+
+/*
+ * Move the root of 'heap', a min-heap of shard numbers ordered by their
+ * 'totals' (then by number), down to its place after its total grew
+ */
+void sift_down_shard(int *heap, int num_shards, const off_t *totals) {
+    int i = 0;
+    while (1) {
+        int lightest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < num_shards; child++) {
+            int a = heap[child], b = heap[lightest];
+            if (totals[a] < totals[b] || (totals[a] == totals[b] && a < b)) {
+                lightest = child;
+            }
+        }
+        if (lightest == i) {
+            return;
+        }
+        int tmp = heap[i];
+        heap[i] = heap[lightest];
+        heap[lightest] = tmp;
+        i = lightest;
+    }
+}
+
+void build_shard(size_t index, int worker, void *arg) {
+    shard_job_t *job = arg;
+    char shard_name[PATH_MAX];
+    shard_archive_name(job->archive_name, (int) index, shard_name, sizeof(shard_name));
+
+    // Each shard gets its own context, so concurrent shards share nothing mutable
+    minitar_ctx_t ctx;
+    minitar_ctx_init_child(&ctx, job->ctx);
+    if (create_archive(&ctx, shard_name, &job->shard_files[index]) != 0) {
+        pthread_mutex_lock(&job->lock);
+        minitar_ctx_merge_error(job->ctx, &ctx);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    minitar_ctx_free(&ctx);
+}
+
+/*
+ * Write the shard manifest: one "SHARD<TAB>MEMBER<TAB>SIZE" line per input, in input order
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_shard_manifest(minitar_ctx_t *ctx, const char *archive_name,
+                         const shard_input_t *inputs, int num_inputs, const char *manifest_name) {
+    FILE *manifest = fopen(manifest_name, "w");
+    if (manifest == NULL) {
+        minitar_perror(ctx, "Failed to open shard manifest");
+        return -1;
+    }
+    char shard_name[PATH_MAX];
+    for (int i = 0; i < num_inputs; i++) {
+        shard_archive_name(archive_name, inputs[i].shard, shard_name, sizeof(shard_name));
+        fprintf(manifest, "%s\t%s\t%lld\n", shard_name, inputs[i].name,
+                (long long) inputs[i].size);
+    }
+    if (fclose(manifest) != 0) {
+        minitar_perror(ctx, "Failed to write shard manifest");
+        return -1;
+    }
+    return 0;
+}
+
+int create_sharded_archives(minitar_ctx_t *ctx, const char *archive_name,
+                            const file_list_t *files) {
+    const minitar_opts_t *opts = &ctx->opts;
+    char shard_name[PATH_MAX];
+    int num_shards = opts->num_shards;
+    if (opts->manifest_out != NULL) {
+        minitar_error(ctx, "--manifest-out can't be combined with shards, use a shard manifest");
+        return -1;
+    }
+    if (shard_archive_name(archive_name, num_shards - 1, shard_name, sizeof(shard_name)) != 0) {
+        minitar_error(ctx, "Archive name too long: %s", archive_name);
+        return -1;
+    }
+
+    // The whole plan lives in one arena and is released with it
+    size_t num_inputs = files->size;
+    arena_t arena;
+    arena_init(&arena, &ctx->allocator);
+    shard_input_t *inputs = arena_alloc(&arena, (num_inputs + 1) * sizeof(shard_input_t));
+    shard_input_t *by_size = arena_alloc(&arena, (num_inputs + 1) * sizeof(shard_input_t));
+    off_t *totals = arena_alloc(&arena, num_shards * sizeof(off_t));
+    int *heap = arena_alloc(&arena, num_shards * sizeof(int));
+    file_list_t *shard_files = arena_alloc(&arena, num_shards * sizeof(file_list_t));
+    int ret = -1;
+    if (inputs == NULL || by_size == NULL || totals == NULL || heap == NULL ||
+        shard_files == NULL) {
+        minitar_perror(ctx, "Failed to allocate shard plan");
+        shard_files = NULL;
+        goto done;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        file_list_init_with(&shard_files[i], &ctx->allocator);
+        totals[i] = 0;
+        heap[i] = i;
+    }
+
+    // Every input is stat'ed exactly once here. The plan only needs payload
+    // sizes, so statx is asked for the type and size alone.
+    // Names are copied since a list's entries don't outlive its iterator
+    size_t num_stated = 0;
+    file_list_iter_t *iter = arena_alloc(&arena, sizeof(file_list_iter_t));
+    if (iter == NULL) {
+        minitar_perror(ctx, "Failed to allocate shard plan");
+        goto done;
+    }
+    for (const char *name = file_list_first(files, iter); name != NULL;
+         name = file_list_next(iter), num_stated++) {
+        struct statx stx;
+        if (minitar_statx(ctx, AT_FDCWD, name, STATX_TYPE | STATX_SIZE, &stx) != 0) {
+            minitar_perror(ctx, "Failed to stat file %s", name);
+            goto done;
+        }
+        inputs[num_stated].name = arena_strdup(&arena, name);
+        if (inputs[num_stated].name == NULL) {
+            minitar_perror(ctx, "Failed to allocate shard plan");
+            goto done;
+        }
+        inputs[num_stated].size = S_ISREG(stx.stx_mode) ? stx.stx_size : 0;
+        inputs[num_stated].index = num_stated;
+    }
+
+    // Greedy largest-first packing: each input goes to the currently lightest
+    // shard, counting the header block each member costs
+    memcpy(by_size, inputs, num_inputs * sizeof(shard_input_t));
+    qsort(by_size, num_inputs, sizeof(shard_input_t), compare_shard_inputs);
+    for (size_t i = 0; i < num_inputs; i++) {
+        int shard = heap[0];
+        totals[shard] += BLOCK_SIZE + by_size[i].size;
+        sift_down_shard(heap, num_shards, totals);
+        inputs[by_size[i].index].shard = shard;
+    }
+
+    // Within a shard members keep their relative input order
+    for (size_t i = 0; i < num_inputs; i++) {
+        if (file_list_add(&shard_files[inputs[i].shard], inputs[i].name) != 0) {
+            minitar_perror(ctx, "Failed to allocate shard plan");
+            goto done;
+        }
+    }
+
+    // Shard builders, pipelined or not, share one buffer pool, so a memory limit
+    // covers all of them,
+    if (minitar_buffers(ctx) == NULL) {
+        minitar_perror(ctx, "Failed to allocate shard buffers");
+        goto done;
+    }
+    // and only as many run at once as the descriptor budget allows
+    long fds_leased;
+    int num_jobs = lease_workers(ctx, opts->num_jobs, SHARD_BUILDER_FDS, &fds_leased);
+    shard_job_t job = {archive_name, shard_files, ctx};
+    job.failed = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    int jobs_ret = parallel_for_placed(&opts->placement, num_jobs, num_shards, build_shard, &job);
+    pthread_mutex_destroy(&job.lock);
+    if (fds_leased > 0) {
+        fd_budget_return(ctx->fd_budget, fds_leased);
+    }
+    if (jobs_ret != 0) {
+        minitar_perror(ctx, "Failed to start shard builders");
+        goto done;
+    }
+    if (job.failed) {
+        goto done;
+    }
+    if (opts->shard_manifest != NULL &&
+        write_shard_manifest(ctx, archive_name, inputs, num_inputs, opts->shard_manifest) != 0) {
+        goto done;
+    }
+    ret = 0;
+
+done:
+    for (int i = 0; shard_files != NULL && i < num_shards; i++) {
+        file_list_clear(&shard_files[i]);
+    }
+    arena_free(&arena);
+    return ret;
+}
+
+/*
+ * scan_archive callback that records where the member ends
+ */
+int track_archive_end(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    off_t *end = arg;
+    *end = member->payload_offset + (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 0;
+}
+
+int append_files_to_archive(minitar_ctx_t *ctx, const char *archive_name,
+                            const file_list_t *files) {
+    // New members go where the last one ends, not where the file does: the
+    // trailer may be longer than two blocks when another tool padded it.
+    // An embedded index goes along with the trailer and is written again
+    // after the new members, with their entries added to the ones it had.
+    index_build_t index;
+    if (index_build_init(ctx, &index) != 0) {
+        return -1;
+    }
+    int has_index = 0;
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1 && errno != ENOENT) {
+        minitar_perror(ctx, "Failed to open archive file %s", archive_name);
+        out_buf_free(&index.out);
+        return -1;
+    }
+    if (fd != -1) {
+        struct stat stat_buf;
+        off_t end = 0;
+        off_t index_offset;
+        uint64_t index_size;
+        int found = fstat(fd, &stat_buf) != 0 ? -1 : find_archive_end(fd, stat_buf.st_size, &end);
+        if (found == 1) {
+            has_index = find_archive_index(fd, end, &index_offset, &index_size);
+            found = has_index < 0 ? -1 : found;
+            end = has_index == 1 ? index_offset : end;
+        }
+        if (found < 0) {
+            minitar_perror(ctx, "Failed to read archive file %s", archive_name);
+            close(fd);
+            out_buf_free(&index.out);
+            return -1;
+        }
+        int ret = 0;
+        if (has_index == 1) {
+            ret = index_load_entries(ctx, &index, fd, index_offset, index_size);
+        }
+        close(fd);
+        // Without an index only the headers say where the last member ends,
+        // and an index asked for now has to list the members already there
+        if (ret == 0 && found == 0 && ctx->opts.embed_index) {
+            ret = scan_archive(ctx, archive_name, add_index_entry, &index);
+            end = index.end;
+        } else if (ret == 0 && found == 0) {
+            ret = scan_archive(ctx, archive_name, track_archive_end, &end);
+        }
+        if (ret == 0 && truncate(archive_name, end) != 0) {
+            minitar_perror(ctx, "Failed to truncate file %s", archive_name);
+            ret = -1;
+        }
+        if (ret != 0) {
+            out_buf_free(&index.out);
+            return -1;
+        }
+    }
+    int ret = write_files_to_archive(ctx, archive_name, files, 0,
+                                     has_index == 1 || ctx->opts.embed_index ? &index : NULL);
+    out_buf_free(&index.out);
+    return ret;
+}
+
+/*
+ * Returns 1 if the checksum stored in 'header' matches its contents, 0 otherwise.
+ * Historic tar implementations (including compute_checksum above) sum the
+ * bytes as signed chars, so both the signed and unsigned sums are accepted.
+ */
+int header_checksum_valid(const tar_header *header) {
+    const unsigned char *bytes = (const unsigned char *) header;
+    long unsigned_sum = 0;
+    long signed_sum = 0;
+    for (int i = 0; i < sizeof(tar_header); i++) {
+        int in_chksum = i >= offsetof(tar_header, chksum) &&
+                        i < offsetof(tar_header, chksum) + sizeof(header->chksum);
+        unsigned char c = in_chksum ? ' ' : bytes[i];
+        unsigned_sum += c;
+        signed_sum += (signed char) c;
+    }
+    uint64_t stored;
+    if (tar_number_parse(header->chksum, sizeof(header->chksum), &stored) != 0) {
+        return 0;
+    }
+    return stored == unsigned_sum || stored == signed_sum;
+}
+
+int scan_archive(minitar_ctx_t *ctx, const char *archive_name, member_callback_t callback,
+                 void *arg) {
+    return scan_archive_from(ctx, archive_name, 0, callback, arg);
+}
+
+// Where scan_archive_from reads header blocks from. Regular files are mapped
+// so walking the headers costs no system calls, anything else falls back to pread.
+typedef struct {
+    int fd;
+    const char *map;    // Whole archive mapped read-only, or NULL
+    off_t len;
+} archive_source_t;
+
+/*
+ * Open the archive identified by 'archive_name' for scanning
+ * Returns 0 on success or -1 if an error occurs
+ */
+int open_archive_source(minitar_ctx_t *ctx, const char *archive_name, archive_source_t *src) {
+    src->map = NULL;
+    src->fd = open(archive_name, O_RDONLY);
+    if (src->fd == -1) {
+        minitar_perror(ctx, "Failed to open archive file");
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(src->fd, &stat_buf) != 0) {
+        minitar_perror(ctx, "Failed to stat archive file");
+        close(src->fd);
+        return -1;
+    }
+    src->len = stat_buf.st_size;
+    if (S_ISREG(stat_buf.st_mode) && src->len > 0) {
+        void *map = mmap(NULL, src->len, PROT_READ, MAP_SHARED, src->fd, 0);
+        if (map != MAP_FAILED) {
+            src->map = map;
+        }
+    }
+    return 0;
+}
+
+void close_archive_source(archive_source_t *src) {
+    if (src->map != NULL) {
+        munmap((void *) src->map, src->len);
+    }
+    close(src->fd);
+}
+
+/*
+ * Get the block at 'offset', either directly from the mapping or by reading it into 'buf'
+ * Returns NULL if there is no complete block at 'offset'
+ */
+const tar_header *read_header_block(const archive_source_t *src, off_t offset, tar_header *buf) {
+    if (src->map != NULL) {
+        if (offset + BLOCK_SIZE > src->len) {
+            return NULL;
+        }
+        return (const tar_header *) (src->map + offset);
+    }
+    if (pread(src->fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Check that the numeric fields every scan_archive callback may use (mode,
+ * mtime and size) decode, and store them in 'member'. The device numbers
+ * are only checked where a device is extracted.
+ * Returns 0 on success or -1 if a field is malformed
+ */
+int decode_header_numbers(const tar_header *header, tar_member_t *member) {
+    uint64_t mode, mtime;
+    if (tar_number_parse(header->mode, sizeof(header->mode), &mode) != 0 ||
+        tar_number_parse(header->mtime, sizeof(header->mtime), &mtime) != 0 ||
+        tar_number_parse(header->size, sizeof(header->size), &member->size) != 0 ||
+        mtime > INT64_MAX) {
+        return -1;
+    }
+    member->mode = mode;
+    member->mtime = mtime;
+    member->real_size = member->size;
+    // Room left to round up to whole blocks in an off_t
+    return member->size <= (uint64_t) INT64_MAX - 2 * BLOCK_SIZE ? 0 : -1;
+}
+
+// What GNU tar keeps where POSIX has the prefix field, overlaid on it
+typedef struct {
+    char atime[12];
+    char ctime[12];
+    char offset[12];
+    char longnames[4];
+    char unused;
+    char sparse[4][2][12];    // Offset and length of the first data regions of a sparse file
+    char isextended;          // Whether extension blocks with more of them follow
+    char realsize[12];        // Size of the whole sparse file
+    char pad[17];
+} gnu_header_extra_t;
+
+// Block after a GNU sparse header that continues its map
+typedef struct {
+    char sparse[21][2][12];
+    char isextended;
+    char pad[7];
+} gnu_sparse_block_t;
+
+// PAX attributes of a member that override its header fields. GNU long names
+// and link targets end up here too. A string is set while its buffer holds
+// the value and a null terminator, and empty otherwise.
+typedef struct {
+    out_buf_t path;
+    out_buf_t linkpath;
+    out_buf_t uname;
+    int has_size;
+    uint64_t size;
+    int has_mtime;
+    long long mtime;
+} pax_attrs_t;
+
+typedef struct scan_state scan_state_t;
+
+// Decodes the member whose first header is 'header' at 'offset' into 'member'
+// Returns 0 on success or -1 (with the error reported) if an error occurs
+typedef int (*member_decoder_t)(minitar_ctx_t *ctx, scan_state_t *scan, const tar_header *header,
+                                off_t offset, tar_member_t *member);
+
+// State of scan_archive_from from one member to the next
+struct scan_state {
+    const char *archive_name;
+    archive_source_t src;
+    member_decoder_t decode;    // Chosen from the first header
+    tar_header buf;             // Header blocks read without a mapping
+    tar_header extra_buf;       // Any other block read without a mapping
+    char name[sizeof(((tar_header *) NULL)->prefix) + 1 + sizeof(((tar_header *) NULL)->name) + 1];
+    char linkname[sizeof(((tar_header *) NULL)->linkname) + 1];
+    char uname[sizeof(((tar_header *) NULL)->uname) + 1];
+    // Only set up once an extension header turns up
+    int extended;
+    pax_attrs_t local;     // For the next member
+    pax_attrs_t global;    // For every later member
+    out_buf_t records;     // Content of the last PAX header
+};
+
+/*
+ * The string in the header field of 'size' bytes at 'field', copied to 'buf'
+ * (of size + 1 bytes) only if it fills the field without a terminator
+ */
+const char *header_string(const char *field, size_t size, char *buf, size_t *len) {
+    *len = strnlen(field, size);
+    if (*len < size) {
+        return field;
+    }
+    memcpy(buf, field, size);
+    buf[size] = '\0';
+    return buf;
+}
+
+/*
+ * Fill in 'member' from its own header 'header' at 'offset'. Only POSIX
+ * ustar headers have a prefix, GNU tar keeps other data in its place.
+ * Returns 0 on success or -1 if a numeric field is malformed
+ */
+int decode_header_fields(scan_state_t *scan, const tar_header *header, off_t offset,
+                         tar_member_t *member) {
+    if (decode_header_numbers(header, member) != 0) {
+        return -1;
+    }
+    member->header = header;
+    member->header_offset = offset;
+    member->payload_offset = offset + BLOCK_SIZE;
+
+    // Fields are used where they are when null-terminated, as they usually are
+    size_t prefix_len = memcmp(header->magic, MAGIC, sizeof(header->magic)) == 0
+                            ? strnlen(header->prefix, sizeof(header->prefix))
+                            : 0;
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    member->name = header->name;
+    member->name_len = name_len;
+    if (prefix_len > 0 || name_len == sizeof(header->name)) {
+        if (prefix_len > 0) {
+            memcpy(scan->name, header->prefix, prefix_len);
+            scan->name[prefix_len++] = '/';
+        }
+        memcpy(scan->name + prefix_len, header->name, name_len);
+        member->name_len = prefix_len + name_len;
+        scan->name[member->name_len] = '\0';
+        member->name = scan->name;
+    }
+    member->linkname = header_string(header->linkname, sizeof(header->linkname), scan->linkname,
+                                     &member->linkname_len);
+    member->uname =
+        header_string(header->uname, sizeof(header->uname), scan->uname, &member->uname_len);
+
+    member->typeflag =
+        header->typeflag == '\0' || header->typeflag == CONTTYPE ? REGTYPE : header->typeflag;
+    return 0;
+}
+
+int decode_extended_member(minitar_ctx_t *ctx, scan_state_t *scan, const tar_header *header,
+                           off_t offset, tar_member_t *member);
+
+/*
+ * Decoder for archives of plain ustar (or pre-POSIX) headers, one per member.
+ * The first header of any other type switches the archive over to
+ * decode_extended_member for good.
+ */
+int decode_ustar_member(minitar_ctx_t *ctx, scan_state_t *scan, const tar_header *header,
+                        off_t offset, tar_member_t *member) {
+    if ((header->typeflag < '0' || header->typeflag > '7') && header->typeflag != '\0') {
+        scan->decode = decode_extended_member;
+        return decode_extended_member(ctx, scan, header, offset, member);
+    }
+    member->start_offset = offset;
+    if (decode_header_fields(scan, header, offset, member) != 0) {
+        minitar_error(ctx, "Malformed header at offset %lld in archive %s", (long long) offset,
+                      scan->archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set up the buffers decode_extended_member needs
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+int scan_extended_init(minitar_ctx_t *ctx, scan_state_t *scan) {
+    out_buf_t *bufs[] = {&scan->local.path,  &scan->local.linkpath,  &scan->local.uname,
+                         &scan->global.path, &scan->global.linkpath, &scan->global.uname,
+                         &scan->records};
+    size_t num_bufs = sizeof(bufs) / sizeof(bufs[0]);
+    for (size_t i = 0; i < num_bufs; i++) {
+        if (out_buf_init(bufs[i], -1, &ctx->allocator) != 0) {
+            while (i-- > 0) {
+                out_buf_free(bufs[i]);
+            }
+            minitar_perror(ctx, "Failed to allocate archive scan state");
+            return -1;
+        }
+        bufs[i]->len = 0;
+    }
+    scan->global.has_size = 0;
+    scan->global.has_mtime = 0;
+    scan->extended = 1;
+    return 0;
+}
+
+void scan_state_free(scan_state_t *scan) {
+    if (scan->extended) {
+        out_buf_free(&scan->local.path);
+        out_buf_free(&scan->local.linkpath);
+        out_buf_free(&scan->local.uname);
+        out_buf_free(&scan->global.path);
+        out_buf_free(&scan->global.linkpath);
+        out_buf_free(&scan->global.uname);
+        out_buf_free(&scan->records);
+    }
+    close_archive_source(&scan->src);
+}
+
+/*
+ * Replace the contents of 'out' with the 'size' bytes of content of the
+ * extension header at 'offset', null-terminated
+ * Returns 0 on success or -1 if the archive ends first or memory runs out
+ */
+int read_extension(scan_state_t *scan, off_t offset, uint64_t size, out_buf_t *out) {
+    out->len = 0;
+    for (uint64_t done = 0; done < size; done += BLOCK_SIZE) {
+        const tar_header *block =
+            read_header_block(&scan->src, offset + BLOCK_SIZE + done, &scan->extra_buf);
+        size_t len = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+        if (block == NULL || out_buf_write(out, block, len) != 0) {
+            return -1;
+        }
+    }
+    return out_buf_putc(out, '\0');
+}
+
+/*
+ * Parse the decimal PAX value of 'len' bytes at 'value' into '*number',
+ * dropping any fractional part (times have one)
+ * Returns 0 on success or -1 if it is not a number
+ */
+int parse_pax_number(const char *value, size_t len, long long *number) {
+    size_t i = len > 1 && value[0] == '-' ? 1 : 0;
+    if (i == len) {
+        return -1;
+    }
+    long long result = 0;
+    for (; i < len && value[i] != '.'; i++) {
+        if (value[i] < '0' || value[i] > '9' || result > (LLONG_MAX - 9) / 10) {
+            return -1;
+        }
+        result = result * 10 + (value[i] - '0');
+    }
+    *number = value[0] == '-' ? -result : result;
+    return 0;
+}
+
+/*
+ * Set the string attribute 'attr' to the 'len' bytes at 'value', or unset it
+ * if 'len' is 0
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+int set_pax_string(out_buf_t *attr, const char *value, size_t len) {
+    attr->len = 0;
+    if (len == 0) {
+        return 0;
+    }
+    return out_buf_write(attr, value, len) != 0 || out_buf_putc(attr, '\0') != 0 ? -1 : 0;
+}
+
+/*
+ * Apply the PAX records ("LENGTH KEY=VALUE\n") in the 'len' bytes at 'records'
+ * to 'attrs'. Keys minitar has no use for are skipped, and an empty value
+ * unsets an attribute.
+ * Returns 0 on success or -1 if a record is malformed or memory runs out
+ */
+int parse_pax_records(const char *records, size_t len, pax_attrs_t *attrs) {
+    while (len > 0) {
+        size_t record_len = 0;
+        size_t i = 0;
+        for (; i < len && records[i] >= '0' && records[i] <= '9' && record_len <= len; i++) {
+            record_len = record_len * 10 + (records[i] - '0');
+        }
+        if (i == 0 || i == len || records[i] != ' ' || record_len <= i + 1 ||
+            record_len > len || records[record_len - 1] != '\n') {
+            return -1;
+        }
+        const char *key = records + i + 1;
+        const char *end = records + record_len - 1;
+        const char *equals = memchr(key, '=', end - key);
+        if (equals == NULL) {
+            return -1;
+        }
+        size_t key_len = equals - key;
+        const char *value = equals + 1;
+        size_t value_len = end - value;
+        long long number = 0;
+        int ret = 0;
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            ret = set_pax_string(&attrs->path, value, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            ret = set_pax_string(&attrs->linkpath, value, value_len);
+        } else if (key_len == 5 && memcmp(key, "uname", 5) == 0) {
+            ret = set_pax_string(&attrs->uname, value, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            attrs->has_size = value_len > 0;
+            ret = value_len > 0 && (parse_pax_number(value, value_len, &number) != 0 ||
+                                    number < 0 || number > INT64_MAX - 2 * BLOCK_SIZE);
+            attrs->size = number;
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            attrs->has_mtime = value_len > 0;
+            ret = value_len > 0 && parse_pax_number(value, value_len, &number) != 0;
+            attrs->mtime = number;
+        }
+        if (ret != 0) {
+            return -1;
+        }
+        records += record_len;
+        len -= record_len;
+    }
+    return 0;
+}
+
+/*
+ * The string attribute set by the member's own extension headers ('local')
+ * if any, otherwise by a global header, or NULL if neither set it
+ */
+const char *pax_string(const out_buf_t *local, const out_buf_t *global, size_t *len) {
+    const out_buf_t *attr = local->len > 0 ? local : global->len > 0 ? global : NULL;
+    if (attr != NULL) {
+        *len = strlen(attr->data);
+    }
+    return attr != NULL ? attr->data : NULL;
+}
+
+/*
+ * Take the size of the whole file from the header of the GNU sparse member
+ * 'member' and move its payload past the blocks continuing its map
+ * Returns 0 on success or -1 if the header is malformed
+ */
+int decode_sparse_member(scan_state_t *scan, const tar_header *header, tar_member_t *member) {
+    const gnu_header_extra_t *gnu = (const gnu_header_extra_t *) header->prefix;
+    if (tar_number_parse(gnu->realsize, sizeof(gnu->realsize), &member->real_size) != 0) {
+        return -1;
+    }
+    for (int extended = gnu->isextended; extended;) {
+        const gnu_sparse_block_t *block = (const gnu_sparse_block_t *) read_header_block(
+            &scan->src, member->payload_offset, &scan->extra_buf);
+        if (block == NULL) {
+            return -1;
+        }
+        extended = block->isextended;
+        member->payload_offset += BLOCK_SIZE;
+    }
+    return 0;
+}
+
+/*
+ * Whether 'typeflag' is that of a header describing the member after it
+ */
+int is_extension_type(char typeflag) {
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME ||
+           typeflag == GNUTYPE_LONGLINK || typeflag == GNUTYPE_VOLHDR;
+}
+
+/*
+ * Decoder for archives in GNU tar's format or with PAX headers. The
+ * extension headers before a member are read and applied to it.
+ */
+int decode_extended_member(minitar_ctx_t *ctx, scan_state_t *scan, const tar_header *header,
+                           off_t offset, tar_member_t *member) {
+    if (!scan->extended && scan_extended_init(ctx, scan) != 0) {
+        return -1;
+    }
+    pax_attrs_t *local = &scan->local;
+    local->path.len = 0;
+    local->linkpath.len = 0;
+    local->uname.len = 0;
+    local->has_size = 0;
+    local->has_mtime = 0;
+
+    member->start_offset = offset;
+    while (is_extension_type(header->typeflag)) {
+        char type = header->typeflag;
+        tar_member_t extension;
+        if (decode_header_numbers(header, &extension) != 0 ||
+            extension.size > EXTENSION_MAX_SIZE) {
+            goto malformed;
+        }
+        out_buf_t *out = type == GNUTYPE_LONGNAME   ? &local->path
+                         : type == GNUTYPE_LONGLINK ? &local->linkpath
+                                                    : &scan->records;
+        // A volume label names the archive rather than a member
+        if (type != GNUTYPE_VOLHDR && read_extension(scan, offset, extension.size, out) != 0) {
+            minitar_error(ctx, "Failed to read extension header at offset %lld in archive %s",
+                          (long long) offset, scan->archive_name);
+            return -1;
+        }
+        if ((type == XHDTYPE || type == XGLTYPE) &&
+            parse_pax_records(out->data, out->len - 1,
+                              type == XHDTYPE ? local : &scan->global) != 0) {
+            goto malformed;
+        }
+
+        off_t next = offset + BLOCK_SIZE + (off_t) ((extension.size + BLOCK_SIZE - 1) /
+                                                    BLOCK_SIZE) * BLOCK_SIZE;
+        // Global headers belong to the archive, not to the member that follows
+        if (type == XGLTYPE && member->start_offset == offset) {
+            member->start_offset = next;
+        }
+        offset = next;
+        header = read_header_block(&scan->src, offset, &scan->buf);
+        if (header == NULL || block_is_zero((const char *) header)) {
+            goto malformed;
+        }
+    }
+
+    if (decode_header_fields(scan, header, offset, member) != 0 ||
+        (header->typeflag == GNUTYPE_SPARSE && decode_sparse_member(scan, header, member) != 0)) {
+        goto malformed;
+    }
+    const char *value;
+    size_t len;
+    if ((value = pax_string(&local->path, &scan->global.path, &len)) != NULL) {
+        member->name = value;
+        member->name_len = len;
+    }
+    if ((value = pax_string(&local->linkpath, &scan->global.linkpath, &len)) != NULL) {
+        member->linkname = value;
+        member->linkname_len = len;
+    }
+    if ((value = pax_string(&local->uname, &scan->global.uname, &len)) != NULL) {
+        member->uname = value;
+        member->uname_len = len;
+    }
+    if (local->has_size || scan->global.has_size) {
+        member->size = local->has_size ? local->size : scan->global.size;
+        member->real_size = member->size;
+    }
+    if (local->has_mtime || scan->global.has_mtime) {
+        member->mtime = local->has_mtime ? local->mtime : scan->global.mtime;
+    }
+    return 0;
+
+malformed:
+    minitar_error(ctx, "Malformed header at offset %lld in archive %s", (long long) offset,
+                  scan->archive_name);
+    return -1;
+}
+
+int scan_archive_from(minitar_ctx_t *ctx, const char *archive_name, off_t start_offset,
+                      member_callback_t callback, void *arg) {
+    scan_state_t scan;
+    scan.archive_name = archive_name;
+    scan.decode = NULL;
+    scan.extended = 0;
+    if (open_archive_source(ctx, archive_name, &scan.src) != 0) {
+        return -1;
+    }
+
+    if (start_offset < 0 || start_offset % BLOCK_SIZE != 0) {
+        minitar_error(ctx, "Invalid start offset %lld for archive %s", (long long) start_offset,
+                archive_name);
+        scan_state_free(&scan);
+        return -1;
+    }
+
+    char block[BLOCK_SIZE] = {0};
+
+    tar_member_t member;
+    off_t header_offset = start_offset;
+    int ret = -1;
+
+    while (1) {
+        const tar_header *header = read_header_block(&scan.src, header_offset, &scan.buf);
+        if (header == NULL) {
+            minitar_error(ctx, "unexpected end of archive file %s", archive_name);
+            break;
+        }
+
+        // check if the block is all zeros (possible first footer block)
+        if ((int)memcmp(header, block, BLOCK_SIZE) == 0) {
+            // read the next block to confirm it's also all zeros
+            header = read_header_block(&scan.src, header_offset + BLOCK_SIZE, &scan.buf);
+            if (header == NULL) {
+                minitar_perror(ctx, "unable to read given archive file, "
+                                    "footers may not be correctly formatted");
+                break;
+            }
+
+            if ((int)memcmp(header, block, BLOCK_SIZE) == 0) {
+                ret = 0;
+                break;
+            }
+            // if it's not a second zero block, print error
+            minitar_perror(ctx, "unexpected all zero block found in tar file");
+            break;
+        }
+
+        // A resumed scan must land exactly on a header
+        if (header_offset == start_offset && start_offset != 0 &&
+            !header_checksum_valid(header)) {
+            minitar_error(ctx, "Offset %lld is not a member header in archive %s",
+                    (long long) start_offset, archive_name);
+            break;
+        }
+
+        // Callbacks can take the member's fields as valid from here on
+        if (scan.decode == NULL) {
+            scan.decode = memcmp(header->magic, GNU_MAGIC, sizeof(GNU_MAGIC)) == 0
+                              ? decode_extended_member
+                              : decode_ustar_member;
+        }
+        if (scan.decode(ctx, &scan, header, header_offset, &member) != 0) {
+            break;
+        }
+
+        // An embedded index describes the archive rather than belonging to it
+        int cb_ret = is_index_member(member.header) ? 0 : callback(ctx, &member, arg);
+        if (cb_ret != 0) {
+            ret = cb_ret > 0 ? 0 : -1;
+            break;
+        }
+
+        // The content padded to whole blocks
+        header_offset = member.payload_offset +
+                        (off_t) ((member.size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+    }
+    scan_state_free(&scan);
+    return ret;
+}
+
+/*
+ * scan_archive callback that adds each member's name to a file_list_t
+ */
+int add_member_name(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    file_list_t *files = arg;
+    if (file_list_add(files, member->name) != 0) {
+        minitar_perror(ctx, "Failed to add member name to list");
+        return -1;
+    }
+    return 0;
+}
+
+int get_archive_file_list(minitar_ctx_t *ctx, const char *archive_name, file_list_t *files) {
+    return scan_archive(ctx, archive_name, add_member_name, files);
+}
+
+typedef struct list_multi list_multi_t;
+
+// State shared by the list_archive callbacks
+typedef struct {
+    out_buf_t out;
+    const char *tag;           // Archive name prefixed to every record, or NULL
+    size_t tag_len;
+    list_multi_t *multi;       // Set when listing several archives at once
+    size_t index;              // Position of this archive in the multi listing
+    list_format_t format;
+    long limit;                // Maximum number of members to list, 0 = no limit
+    long count;                // Number of members listed so far
+    off_t next_offset;         // Header offset of the first unlisted member, -1 = none
+    name_map_t generations;    // Name -> number of versions seen so far
+    char *escaped;             // Reused buffer for escaping names
+    size_t escaped_cap;
+} list_state_t;
+
+int list_record_done(minitar_ctx_t *ctx, list_state_t *state);
+
+/*
+ * Make sure the escape buffer can hold the escaped form of 'len' bytes
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+int reserve_escape_buffer(minitar_ctx_t *ctx, list_state_t *state, size_t len) {
+    // The longest escape of a single byte is the 6 byte JSON form \u00XX
+    size_t needed = 6 * len;
+    if (needed <= state->escaped_cap) {
+        return 0;
+    }
+    char *new_buf = minitar_realloc(ctx, state->escaped, needed);
+    if (new_buf == NULL) {
+        return -1;
+    }
+    state->escaped = new_buf;
+    state->escaped_cap = needed;
+    return 0;
+}
+
+/*
+ * Escape 'len' bytes of 'src' as the body of a JSON string into 'dst',
+ * which must have room for 6 * len bytes.
+ * Bytes >= 0x80 are copied as-is, names are assumed to be UTF-8.
+ * Returns the escaped length
+ */
+size_t json_escape(const char *src, size_t len, char *dst) {
+    static const char hex[] = "0123456789abcdef";
+    char *out = dst;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = src[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+        } else if (c == '\t') {
+            *out++ = '\\';
+            *out++ = 't';
+        } else if (c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xf];
+            out += 6;
+        } else {
+            *out++ = c;
+        }
+    }
+    return out - dst;
+}
+
+/*
+ * Escape tabs, newlines and backslashes in 'len' bytes of 'src' into 'dst',
+ * which must have room for 2 * len bytes.
+ * Returns the escaped length
+ */
+size_t tsv_escape(const char *src, size_t len, char *dst) {
+    char *out = dst;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == '\t' || src[i] == '\n' || src[i] == '\\') {
+            *out++ = '\\';
+            *out++ = src[i] == '\t' ? 't' : src[i] == '\n' ? 'n' : '\\';
+        } else {
+            *out++ = src[i];
+        }
+    }
+    return out - dst;
+}
+
+/*
+ * scan_archive callback that writes one listing record per member
+ */
+int write_member_record(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    list_state_t *state = arg;
+    out_buf_t *out = &state->out;
+    size_t name_len = member->name_len;
+
+    // One member past the page proves there is a next page and gives its cursor
+    if (state->limit > 0 && state->count == state->limit) {
+        state->next_offset = member->start_offset;
+        return 1;
+    }
+    state->count++;
+
+    if (state->format == LIST_PLAIN) {
+        if ((state->tag != NULL && (out_buf_write(out, state->tag, state->tag_len) != 0 ||
+                                    out_buf_putc(out, ':') != 0)) ||
+            out_buf_write(out, member->name, name_len) != 0 || out_buf_putc(out, '\n') != 0) {
+            minitar_perror(ctx, "Failed to write archive listing");
+            return -1;
+        }
+        return list_record_done(ctx, state);
+    }
+
+    size_t uname_len = member->uname_len;
+    long *generation = name_map_put(&state->generations, member->name, NULL);
+    size_t longest = name_len > uname_len ? name_len : uname_len;
+    longest = longest > state->tag_len ? longest : state->tag_len;
+    if (generation == NULL || reserve_escape_buffer(ctx, state, longest) != 0) {
+        minitar_perror(ctx, "Failed to allocate listing state");
+        return -1;
+    }
+    (*generation)++;
+
+    long long size = member->real_size;
+    long long mtime = member->mtime;
+    long long mode = member->mode;
+    long long header_offset = member->start_offset;
+    long long payload_offset = member->payload_offset;
+
+    // Everything except the name fits comfortably in a fixed-size buffer
+    char fields[256];
+    int fields_len;
+    size_t escaped_len;
+    int ret = 0;
+    switch (state->format) {
+    case LIST_JSONL:
+        ret |= out_buf_putc(out, '{');
+        if (state->tag != NULL) {
+            escaped_len = json_escape(state->tag, state->tag_len, state->escaped);
+            ret |= out_buf_write(out, "\"archive\":\"", 11);
+            ret |= out_buf_write(out, state->escaped, escaped_len);
+            ret |= out_buf_write(out, "\",", 2);
+        }
+        escaped_len = json_escape(member->name, name_len, state->escaped);
+        ret |= out_buf_write(out, "\"name\":\"", 8);
+        ret |= out_buf_write(out, state->escaped, escaped_len);
+        fields_len = snprintf(fields, sizeof(fields),
+                              "\",\"size\":%lld,\"mtime\":%lld,\"mode\":%lld,\"uname\":\"",
+                              size, mtime, mode);
+        ret |= out_buf_write(out, fields, fields_len);
+        escaped_len = json_escape(member->uname, uname_len, state->escaped);
+        ret |= out_buf_write(out, state->escaped, escaped_len);
+        fields_len = snprintf(fields, sizeof(fields),
+                              "\",\"header_offset\":%lld,\"payload_offset\":%lld,"
+                              "\"generation\":%ld}\n",
+                              header_offset, payload_offset, *generation);
+        ret |= out_buf_write(out, fields, fields_len);
+        break;
+    case LIST_TSV:
+        if (state->tag != NULL) {
+            escaped_len = tsv_escape(state->tag, state->tag_len, state->escaped);
+            ret |= out_buf_write(out, state->escaped, escaped_len);
+            ret |= out_buf_putc(out, '\t');
+        }
+        escaped_len = tsv_escape(member->name, name_len, state->escaped);
+        ret |= out_buf_write(out, state->escaped, escaped_len);
+        fields_len = snprintf(fields, sizeof(fields),
+                              "\t%lld\t%lld\t%04llo\t%.*s\t%lld\t%lld\t%ld\n", size, mtime, mode,
+                              (int) uname_len, member->uname, header_offset,
+                              payload_offset, *generation);
+        ret |= out_buf_write(out, fields, fields_len);
+        break;
+    default:
+        if (state->tag != NULL) {
+            ret |= out_buf_write(out, state->tag, state->tag_len + 1);
+        }
+        ret |= out_buf_write(out, member->name, name_len);
+        fields_len = snprintf(fields, sizeof(fields),
+                              "%c%lld%c%lld%c%04llo%c%.*s%c%lld%c%lld%c%ld%c", '\0', size, '\0',
+                              mtime, '\0', mode, '\0', (int) uname_len, member->uname, '\0',
+                              header_offset, '\0', payload_offset, '\0', *generation,
+                              '\0');
+        ret |= out_buf_write(out, fields, fields_len);
+        break;
+    }
+    if (ret != 0) {
+        minitar_perror(ctx, "Failed to write archive listing");
+        return -1;
+    }
+    return list_record_done(ctx, state);
+}
 
-//         // Read and write the file content
-//         size_t remaining_bytes = file_size;
-//         while (remaining_bytes > 0) {
-//             size_t bytes_to_read = (remaining_bytes < BLOCK_SIZE) ? remaining_bytes : BLOCK_SIZE;
-//             bytes_read = fread(buffer, 1, bytes_to_read, archive);
-//             if (bytes_read != bytes_to_read) {
-//                 perror("Failed to read file content from archive");
-//                 fclose(output_file);
-//                 fclose(archive);
-//                 return -1;
-//             }
-//             fwrite(buffer, 1, bytes_read, output_file);
-//             remaining_bytes -= bytes_read;
-//         }
+/*
+ * Set up 'state' to list into 'out_fd' (-1 collects the listing in memory).
+ * Its buffers come from 'allocator', which must live as long as the state.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int list_state_init(minitar_ctx_t *ctx, list_state_t *state, int out_fd,
+                    const minitar_allocator_t *allocator) {
+    const minitar_opts_t *opts = &ctx->opts;
+    state->tag = NULL;
+    state->tag_len = 0;
+    state->multi = NULL;
+    state->index = 0;
+    state->format = opts->list_format;
+    state->limit = opts->list_limit;
+    state->count = 0;
+    state->next_offset = -1;
+    name_map_init_with(&state->generations, sizeof(long), allocator);
+    // Preallocated for the longest name a ustar header can hold
+    state->escaped_cap = 6 * sizeof(((tar_header *) NULL)->name);
+    state->escaped = minitar_malloc(ctx, state->escaped_cap);
+    if (state->escaped == NULL || out_buf_init(&state->out, out_fd, allocator) != 0) {
+        minitar_perror(ctx, "Failed to allocate output buffer");
+        minitar_free(ctx, state->escaped);
+        return -1;
+    }
+    return 0;
+}
 
-//         // Close the output file
-//         fclose(output_file);
+void list_state_free(minitar_ctx_t *ctx, list_state_t *state) {
+    out_buf_free(&state->out);
+    name_map_clear(&state->generations);
+    minitar_free(ctx, state->escaped);
+}
 
-//         // Skip padding after the file content
-//         size_t padding_size = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
-//         if (padding_size > 0) {
-//             fseek(archive, padding_size, SEEK_CUR);
-//         }
-//     }
+int list_archive(minitar_ctx_t *ctx, const char *archive_name, int out_fd) {
+    list_state_t state;
+    ctx->list_next_offset = -1;
+    if (list_state_init(ctx, &state, out_fd, &ctx->allocator) != 0) {
+        return -1;
+    }
+
+    int ret = scan_archive_from(ctx, archive_name, ctx->opts.list_start_offset,
+                                write_member_record, &state);
+    // Whatever was listed before an error is still written out
+    if (out_buf_flush(&state.out) != 0) {
+        minitar_perror(ctx, "Failed to write archive listing");
+        ret = -1;
+    }
+    if (ret == 0) {
+        ctx->list_next_offset = state.next_offset;
+    }
+    list_state_free(ctx, &state);
+    return ret;
+}
+
+// Coordinates the output of archives listed concurrently by list_archives.
+// Each archive is listed into its own in-memory buffer. In ordered mode only
+// the archive at the head of the output ('next_to_emit') may stream its
+// buffer as it goes; the others hand over their complete listing once every
+// archive before them is done. In unordered mode any archive streams whole
+// buffers as they fill up. Buffers are always written under 'lock', so
+// records from different archives never interleave.
+// Under a memory limit ('bounded') a listing whose buffer fills up before its
+// turn waits on 'turn' instead of growing, so memory stays at one buffer per thread.
+struct list_multi {
+    const char **archive_names;
+    minitar_ctx_t *ctx;         // Parent context, errors are merged into it under 'lock'
+    int unordered;
+    int bounded;
+    int out_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;        // Signalled whenever 'next_to_emit' moves on
+    size_t num_archives;
+    size_t next_to_emit;
+    list_state_t **finished;    // Completed listings waiting for their turn, by index
+    char *done;                 // Whether each archive has been listed (or failed)
+    int failed;
+};
+
+/*
+ * Write the buffered part of a listing to the shared output if it may go out now
+ * Called with the multi listing's lock held
+ * Returns 0 on success or -1 if a write fails
+ */
+int list_emit_locked(minitar_ctx_t *ctx, list_multi_t *multi, list_state_t *state) {
+    if (!multi->unordered && state->index != multi->next_to_emit) {
+        return 0;
+    }
+    if (out_buf_drain_to(&state->out, multi->out_fd) != 0) {
+        minitar_perror(ctx, "Failed to write archive listing");
+        return -1;
+    }
+    return 0;
+}
+
+int list_record_done(minitar_ctx_t *ctx, list_state_t *state) {
+    // Keep a streaming listing's memory bounded by its buffer size
+    if (state->multi == NULL || state->out.len < OUT_BUF_SIZE) {
+        return 0;
+    }
+    list_multi_t *multi = state->multi;
+    pthread_mutex_lock(&multi->lock);
+    // The head of the output is always being listed by some thread and never
+    // waits, so every waiter eventually gets its turn
+    while (multi->bounded && !multi->unordered && state->index != multi->next_to_emit) {
+        pthread_cond_wait(&multi->turn, &multi->lock);
+    }
+    int ret = list_emit_locked(ctx, multi, state);
+    pthread_mutex_unlock(&multi->lock);
+    return ret;
+}
+
+void list_release(minitar_ctx_t *ctx, list_state_t *state) {
+    if (state != NULL) {
+        list_state_free(ctx, state);
+        minitar_free(ctx, state);
+    }
+}
+
+void list_one_of_many(size_t index, int worker, void *arg) {
+    list_multi_t *multi = arg;
+    // Errors are collected per archive and merged into the parent under the lock
+    minitar_ctx_t ctx;
+    minitar_ctx_init_child(&ctx, multi->ctx);
+    int failed = 0;
+    // A finished listing may be released by another worker after this
+    // context is gone, so its buffers hang off the parent's allocator
+    list_state_t *state = minitar_malloc(&ctx, sizeof(list_state_t));
+    if (state == NULL || list_state_init(&ctx, state, -1, &multi->ctx->allocator) != 0) {
+        if (state == NULL) {
+            minitar_perror(&ctx, "Failed to allocate listing state");
+        }
+        minitar_free(&ctx, state);
+        // Nothing to emit, but later archives must not wait on this one forever
+        state = NULL;
+        failed = 1;
+    } else {
+        state->tag = multi->archive_names[index];
+        state->tag_len = strlen(state->tag);
+        state->multi = multi;
+        state->index = index;
+        failed = scan_archive(&ctx, state->tag, write_member_record, state) != 0;
+    }
+
+    pthread_mutex_lock(&multi->lock);
+    multi->failed |= failed;
+    if (multi->unordered) {
+        if (state != NULL && list_emit_locked(&ctx, multi, state) != 0) {
+            multi->failed = 1;
+        }
+        list_release(&ctx, state);
+    } else {
+        // Emit every finished listing from the head of the output onwards
+        multi->finished[index] = state;
+        multi->done[index] = 1;
+        while (multi->next_to_emit < multi->num_archives && multi->done[multi->next_to_emit]) {
+            list_state_t *head = multi->finished[multi->next_to_emit];
+            if (head != NULL && list_emit_locked(&ctx, multi, head) != 0) {
+                multi->failed = 1;
+            }
+            list_release(&ctx, head);
+            multi->finished[multi->next_to_emit++] = NULL;
+            pthread_cond_broadcast(&multi->turn);
+        }
+    }
+    minitar_ctx_merge_error(multi->ctx, &ctx);
+    pthread_mutex_unlock(&multi->lock);
+    minitar_ctx_free(&ctx);
+}
+
+int list_archives(minitar_ctx_t *ctx, const char **archive_names, size_t num_archives,
+                  int out_fd) {
+    list_multi_t multi;
+    multi.archive_names = archive_names;
+    multi.ctx = ctx;
+    multi.unordered = ctx->opts.list_unordered;
+    multi.bounded = ctx->opts.memory_limit != 0;
+    multi.out_fd = out_fd;
+    multi.num_archives = num_archives;
+    multi.next_to_emit = 0;
+    multi.failed = 0;
+    multi.finished = minitar_calloc(ctx, num_archives, sizeof(list_state_t *));
+    multi.done = minitar_calloc(ctx, num_archives, 1);
+    if (multi.finished == NULL || multi.done == NULL) {
+        minitar_perror(ctx, "Failed to allocate listing state");
+        minitar_free(ctx, multi.finished);
+        minitar_free(ctx, multi.done);
+        return -1;
+    }
+    pthread_mutex_init(&multi.lock, NULL);
+    pthread_cond_init(&multi.turn, NULL);
+
+    // Each listing thread has one archive open at a time
+    long fds_leased;
+    int num_jobs = lease_workers(ctx, ctx->opts.num_jobs, 1, &fds_leased);
+    int ret = parallel_for_placed(&ctx->opts.placement, num_jobs, num_archives, list_one_of_many,
+                                  &multi);
+    if (fds_leased > 0) {
+        fd_budget_return(ctx->fd_budget, fds_leased);
+    }
+    if (ret != 0) {
+        minitar_perror(ctx, "Failed to start listing threads");
+    } else if (multi.failed) {
+        ret = -1;
+    }
+
+    pthread_mutex_destroy(&multi.lock);
+    pthread_cond_destroy(&multi.turn);
+    minitar_free(ctx, multi.finished);
+    minitar_free(ctx, multi.done);
+    return ret;
+}
+
+// Byte range occupied by the most recent version of a named member
+typedef struct {
+    const char *name;
+    off_t start;    // Offset of the member's header block
+    off_t end;      // Offset just past the member's padded content
+    int found;
+} member_range_t;
+
+/*
+ * scan_archive callback that records the range of a member whose name matches
+ * Later versions of the member overwrite earlier ones
+ */
+int find_member_range(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    member_range_t *range = arg;
+    if (strcmp(member->name, range->name) == 0) {
+        range->start = member->header_offset;
+        range->end = member->payload_offset +
+                     ((member->size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+        range->found = 1;
+    }
+    return 0;
+}
+
+// Byte range of a member according to an embedded index
+typedef struct {
+    off_t start;
+    off_t end;
+} index_range_t;
+
+/*
+ * Load the ranges of the most recent version of every member listed in the
+ * embedded index of the archive open as 'fd' into 'ranges', which maps names
+ * to index_range_t
+ * Returns 1 once loaded, 0 if the archive has no index or -1 if an error occurs
+ */
+int load_archive_index(minitar_ctx_t *ctx, int fd, name_map_t *ranges) {
+    struct stat stat_buf;
+    off_t end, index_offset;
+    uint64_t index_size;
+    // An index ends where the members do, which is known whenever it exists
+    int found = fstat(fd, &stat_buf) != 0 ? -1 : find_archive_end(fd, stat_buf.st_size, &end);
+    if (found == 1) {
+        found = find_archive_index(fd, end, &index_offset, &index_size);
+    }
+    if (found != 1) {
+        if (found < 0) {
+            minitar_perror(ctx, "Failed to read archive index");
+        }
+        return found;
+    }
+    char *payload = read_index_payload(ctx, fd, index_offset, index_size);
+    if (payload == NULL) {
+        return -1;
+    }
+
+    int ret = 1;
+    char *line = payload + strlen(INDEX_HEADER_LINE);
+    // Entries run up to the first blank line of the padding
+    while (*line != '\n' && *line != '\0') {
+        char *end = strchr(line, '\n');
+        // The name follows the fifth tab
+        char *name = line;
+        for (int field = 0; field < 5 && name != NULL && end != NULL; field++) {
+            name = memchr(name, '\t', end - name);
+            name = name != NULL ? name + 1 : NULL;
+        }
+        if (end == NULL || name == NULL) {
+            minitar_error(ctx, "Malformed archive index entry");
+            ret = -1;
+            break;
+        }
+        // Undo the TSV escapes in place, the result is never longer
+        char *out = name;
+        for (char *in = name; in < end; in++) {
+            if (*in == '\\' && in + 1 < end) {
+                in++;
+                *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+            } else {
+                *out++ = *in;
+            }
+        }
+        *out = '\0';
+        long long header_offset = strtoll(line, &line, 10);
+        long long size = strtoll(line + 1, NULL, 10);
+        index_range_t *range = name_map_put(ranges, name, NULL);
+        if (range == NULL) {
+            minitar_perror(ctx, "Failed to allocate archive index");
+            ret = -1;
+            break;
+        }
+        range->start = header_offset;
+        range->end = header_offset + BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        line = end + 1;
+    }
+    minitar_free(ctx, payload);
+    return ret;
+}
+
+int verify_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *members,
+                   int out_fd) {
+    char sidecar_name[PATH_MAX];
+    if (merkle_sidecar_name(archive_name, sidecar_name, sizeof(sidecar_name)) != 0) {
+        minitar_error(ctx, "Archive name too long: %s", archive_name);
+        return -1;
+    }
+
+    merkle_tree_t tree;
+    if (merkle_load(ctx, sidecar_name, &tree) != 0) {
+        minitar_error(ctx, "Missing or malformed Merkle sidecar %s", sidecar_name);
+        return -1;
+    }
+
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        minitar_perror(ctx, "Failed to open archive file: %s", archive_name);
+        merkle_free(&tree);
+        return -1;
+    }
+
+    int ret = 0;
+    if (members->size == 0) {
+        // Whole archive: the length must match as well as every chunk
+        struct stat stat_buf;
+        if (fstat(archive_fd, &stat_buf) != 0 || (uint64_t) stat_buf.st_size != tree.archive_len) {
+            minitar_error(ctx, "Archive %s is not the length recorded in its Merkle tree",
+                    archive_name);
+            ret = -1;
+        } else if (tree.num_leaves == 0 ||
+                   merkle_verify_range(ctx, &tree, archive_fd, 0, tree.num_leaves - 1) != 0) {
+            ret = -1;
+        }
+        dprintf(out_fd, "%s: %s\n", archive_name, ret == 0 ? "OK" : "FAILED");
+    }
+
+    // With an embedded index members are looked up in it rather than by
+    // scanning the whole archive for each of them
+    name_map_t index;
+    name_map_init_with(&index, sizeof(index_range_t), &ctx->allocator);
+    int has_index = members->size > 0 ? load_archive_index(ctx, archive_fd, &index) : 0;
+    if (has_index < 0) {
+        ret = -1;
+    }
+    file_list_iter_t iter;
+    for (const char *name = file_list_first(members, &iter); name != NULL && has_index >= 0;
+         name = file_list_next(&iter)) {
+        member_range_t range = {name, 0, 0, 0};
+        int member_ret = 0;
+        const index_range_t *entry = has_index ? name_map_get(&index, name) : NULL;
+        if (entry != NULL) {
+            range.start = entry->start;
+            range.end = entry->end;
+            range.found = 1;
+        }
+        if (!has_index && scan_archive(ctx, archive_name, find_member_range, &range) != 0) {
+            member_ret = -1;
+        } else if (!range.found) {
+            minitar_error(ctx, "%s is not present in archive %s", name, archive_name);
+            member_ret = -1;
+        } else if ((uint64_t) range.end > tree.archive_len) {
+            minitar_error(ctx, "%s extends past the end of the Merkle tree", name);
+            member_ret = -1;
+        } else if (merkle_verify_range(ctx, &tree, archive_fd, range.start / tree.chunk_size,
+                                       (range.end - 1) / tree.chunk_size) != 0) {
+            member_ret = -1;
+        }
+        dprintf(out_fd, "%s: %s\n", name, member_ret == 0 ? "OK" : "FAILED");
+        if (member_ret != 0) {
+            ret = -1;
+        }
+    }
+
+    name_map_clear(&index);
+    close(archive_fd);
+    merkle_free(&tree);
+    return ret;
+}
+
+// Most recent version of a member, as seen by diff_archives
+typedef struct {
+    off_t payload_offset;
+    long long size;
+    long long mtime;
+    long long mode;
+    char typeflag;
+    // Digest of the link target, which can be any length (all zeros if none)
+    uint8_t linkname_digest[SHA256_DIGEST_LEN];
+} member_info_t;
+
+/*
+ * scan_archive callback that records every member in a name map of
+ * member_info_t, later versions of a name overwriting earlier ones
+ */
+int record_member_info(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    name_map_t *members = arg;
+    member_info_t *info = name_map_put(members, member->name, NULL);
+    if (info == NULL) {
+        minitar_perror(ctx, "Failed to allocate member map");
+        return -1;
+    }
+    info->payload_offset = member->payload_offset;
+    info->size = member->size;
+    info->mtime = member->mtime;
+    info->mode = member->mode;
+    info->typeflag = member->typeflag;
+    memset(info->linkname_digest, 0, sizeof(info->linkname_digest));
+    if (member->linkname_len > 0) {
+        sha256(member->linkname, member->linkname_len, info->linkname_digest);
+    }
+    return 0;
+}
+
+/*
+ * Compare 'size' bytes of payload at 'offset_a' in 'fd_a' and 'offset_b' in 'fd_b'
+ * Returns 1 if they are identical, 0 if they differ or -1 if an error occurs
+ */
+int payloads_equal(minitar_ctx_t *ctx, int fd_a, off_t offset_a, int fd_b, off_t offset_b,
+                   long long size) {
+    char buf_a[BUFSIZ * 8], buf_b[BUFSIZ * 8];
+    while (size > 0) {
+        size_t want = size < (long long) sizeof(buf_a) ? (size_t) size : sizeof(buf_a);
+        ssize_t got_a = pread(fd_a, buf_a, want, offset_a);
+        ssize_t got_b = pread(fd_b, buf_b, want, offset_b);
+        if (got_a == -1 || got_b == -1) {
+            minitar_perror(ctx, "Failed to read member contents");
+            return -1;
+        }
+        // A truncated archive can't match one that holds the whole member
+        if (got_a != got_b || got_a == 0 || memcmp(buf_a, buf_b, got_a) != 0) {
+            return 0;
+        }
+        offset_a += got_a;
+        offset_b += got_a;
+        size -= got_a;
+    }
+    return 1;
+}
+
+int diff_archives(minitar_ctx_t *ctx, const char *archive_a, const char *archive_b, int out_fd) {
+    name_map_t members_a, members_b;
+    name_map_init_with(&members_a, sizeof(member_info_t), &ctx->allocator);
+    name_map_init_with(&members_b, sizeof(member_info_t), &ctx->allocator);
+    int fd_a = -1, fd_b = -1;
+    int ret = -1;
+
+    if (scan_archive(ctx, archive_a, record_member_info, &members_a) != 0 ||
+        scan_archive(ctx, archive_b, record_member_info, &members_b) != 0) {
+        goto done;
+    }
+
+    int differ = 0;
+    for (size_t i = 0; i < members_a.count; i++) {
+        const char *name = name_map_key(&members_a, i);
+        const member_info_t *info_a = name_map_value(&members_a, i);
+        const member_info_t *info_b = name_map_get(&members_b, name);
+        if (info_b == NULL) {
+            dprintf(out_fd, "D %s\n", name);
+            differ = 1;
+            continue;
+        }
+
+        // Metadata settles most members: a different type, link target, size
+        // or mode is a change, identical size and mtime is taken as unchanged
+        int modified;
+        if (info_a->typeflag != info_b->typeflag ||
+            memcmp(info_a->linkname_digest, info_b->linkname_digest,
+                   sizeof(info_a->linkname_digest)) != 0 ||
+            info_a->size != info_b->size || info_a->mode != info_b->mode) {
+            modified = 1;
+        } else if (info_a->mtime == info_b->mtime) {
+            modified = 0;
+        } else {
+            // Only touched, or rewritten with the same size: look at the data
+            if (fd_a == -1 && (fd_a = open(archive_a, O_RDONLY)) == -1) {
+                minitar_perror(ctx, "Failed to open archive file: %s", archive_a);
+                goto done;
+            }
+            if (fd_b == -1 && (fd_b = open(archive_b, O_RDONLY)) == -1) {
+                minitar_perror(ctx, "Failed to open archive file: %s", archive_b);
+                goto done;
+            }
+            int equal = payloads_equal(ctx, fd_a, info_a->payload_offset, fd_b,
+                                       info_b->payload_offset, info_a->size);
+            if (equal == -1) {
+                goto done;
+            }
+            modified = !equal;
+        }
+        if (modified) {
+            dprintf(out_fd, "M %s\n", name);
+            differ = 1;
+        }
+    }
+
+    for (size_t i = 0; i < members_b.count; i++) {
+        const char *name = name_map_key(&members_b, i);
+        if (name_map_get(&members_a, name) == NULL) {
+            dprintf(out_fd, "A %s\n", name);
+            differ = 1;
+        }
+    }
+    ret = differ;
+
+done:
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    name_map_clear(&members_a);
+    name_map_clear(&members_b);
+    return ret;
+}
+
+// Version of a member chosen so far by merge_archives
+typedef struct {
+    int archive;          // Index of the input archive holding it
+    off_t start_offset;   // Its first header, extension headers included
+    off_t end_offset;     // Just past its padded content
+    long long mtime;
+} merge_choice_t;
+
+// State of the merge_archives scan over one input archive
+typedef struct {
+    name_map_t *choices;
+    int archive;
+    merge_policy_t policy;
+} merge_scan_t;
+
+/*
+ * scan_archive callback that offers each member of an input archive as the
+ * version to keep, according to the merge policy
+ */
+int choose_merge_member(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    merge_scan_t *scan = arg;
+    int created;
+    merge_choice_t *choice = name_map_put(scan->choices, member->name, &created);
+    if (choice == NULL) {
+        minitar_perror(ctx, "Failed to allocate member map");
+        return -1;
+    }
+    // Ties go to the later version, just as extraction would leave it
+    if (created || scan->policy == MERGE_LAST || member->mtime >= choice->mtime) {
+        choice->archive = scan->archive;
+        choice->start_offset = member->start_offset;
+        choice->end_offset = member->payload_offset +
+                             (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        choice->mtime = member->mtime;
+    }
+    return 0;
+}
+
+/*
+ * Copy 'len' bytes at 'offset' in 'in_fd' to the current position of 'out_fd'.
+ * The kernel moves the data with copy_file_range (sharing extents where the
+ * file system supports it); pread/write is only used where it is unavailable.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int copy_archive_range(minitar_ctx_t *ctx, int in_fd, off_t offset, int out_fd, off_t len) {
+    while (len > 0) {
+        ssize_t copied = copy_file_range(in_fd, &offset, out_fd, NULL, len, 0);
+        if (copied > 0) {
+            len -= copied;
+            continue;
+        }
+        if (copied == 0) {
+            minitar_error(ctx, "Archive member is truncated");
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+
+        char buf[BUFSIZ * 8];
+        while (len > 0) {
+            size_t want = len < (off_t) sizeof(buf) ? (size_t) len : sizeof(buf);
+            ssize_t got = pread(in_fd, buf, want, offset);
+            if (got <= 0) {
+                if (got == 0) {
+                    minitar_error(ctx, "Archive member is truncated");
+                }
+                return -1;
+            }
+            if (write(out_fd, buf, got) != got) {
+                return -1;
+            }
+            offset += got;
+            len -= got;
+        }
+    }
+    return 0;
+}
+
+int merge_archives(minitar_ctx_t *ctx, const char *out_name, const char **archive_names,
+                   int num_archives) {
+    struct stat out_stat, in_stat;
+    int out_exists = stat(out_name, &out_stat) == 0;
+    for (int i = 0; i < num_archives; i++) {
+        if (out_exists && stat(archive_names[i], &in_stat) == 0 &&
+            in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+            minitar_error(ctx, "Merged archive %s can't also be an input", out_name);
+            return -1;
+        }
+    }
+
+    name_map_t choices;
+    name_map_init_with(&choices, sizeof(merge_choice_t), &ctx->allocator);
+    // Inputs are read through an LRU cache of descriptors no bigger than the
+    // budget allows, so any number of them can be merged
+    fd_budget_t *budget = minitar_fd_budget(ctx);
+    long leased = 0;
+    fd_cache_t inputs = {.fds = NULL};
+    int out_fd = -1;
+    int ret = -1;
+    if (budget == NULL) {
+        minitar_perror(ctx, "Failed to allocate merge state");
+        goto done;
+    }
+    leased = fd_budget_lease(budget, 1, num_archives);
+    if (fd_cache_init(&inputs, &ctx->allocator, archive_names, num_archives, O_RDONLY, leased) !=
+        0) {
+        minitar_perror(ctx, "Failed to allocate merge state");
+        goto done;
+    }
+
+    // Pick the version of every name from the headers alone
+    for (int i = 0; i < num_archives; i++) {
+        merge_scan_t scan = {&choices, i, ctx->opts.merge_policy};
+        if (scan_archive(ctx, archive_names[i], choose_merge_member, &scan) != 0) {
+            goto done;
+        }
+    }
+
+    out_fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        minitar_perror(ctx, "Failed to open archive file: %s", out_name);
+        goto done;
+    }
+    // A sidecar left over from an earlier archive of this name no longer applies
+    char sidecar_name[PATH_MAX];
+    if (merkle_sidecar_name(out_name, sidecar_name, sizeof(sidecar_name)) == 0) {
+        unlink(sidecar_name);
+    }
+
+    // Each chosen member's header blocks and padded payload are copied
+    // unchanged, in the order names were first seen across the inputs
+    for (size_t i = 0; i < choices.count; i++) {
+        const merge_choice_t *choice = name_map_value(&choices, i);
+        int in_fd = fd_cache_get(&inputs, choice->archive);
+        if (in_fd == -1) {
+            minitar_perror(ctx, "Failed to open archive file: %s", archive_names[choice->archive]);
+            goto done;
+        }
+        if (copy_archive_range(ctx, in_fd, choice->start_offset, out_fd,
+                               choice->end_offset - choice->start_offset) != 0) {
+            minitar_perror(ctx, "Failed to copy member from %s", archive_names[choice->archive]);
+            goto done;
+        }
+    }
+
+    char trailer[NUM_TRAILING_BLOCKS * BLOCK_SIZE];
+    memset(trailer, 0, sizeof(trailer));
+    if (write(out_fd, trailer, sizeof(trailer)) != sizeof(trailer)) {
+        minitar_perror(ctx, "Failed to write footer to archive");
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if (out_fd != -1 && close(out_fd) != 0 && ret == 0) {
+        minitar_perror(ctx, "Failed to close archive");
+        ret = -1;
+    }
+    if (inputs.fds != NULL) {
+        fd_cache_free(&inputs);
+    }
+    if (leased > 0) {
+        fd_budget_return(budget, leased);
+    }
+    name_map_clear(&choices);
+    return ret;
+}
 
-//     // Close the archive file
-//     fclose(archive);
+// State of extract_files_from_archive while it walks the archive
+typedef struct {
+    int archive_fd;
+    int failed;    // Some member could not be extracted, the rest still are
+} extract_state_t;
 
-    printf("Extraction complete.\n");
+/*
+ * Whether 'name' stays below the directory it is extracted into, that is it
+ * is relative and has no ".." component
+ */
+int extract_name_safe(const char *name) {
+    if (name[0] == '/' || name[0] == '\0') {
+        return 0;
+    }
+    for (const char *component = name; component != NULL;
+         component = strchr(component, '/') != NULL ? strchr(component, '/') + 1 : NULL) {
+        if (component[0] == '.' && component[1] == '.' &&
+            (component[2] == '/' || component[2] == '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Open the directory that is to hold 'path', creating missing directories on
+ * the way, and point '*base' at the last component of 'path'. Every directory
+ * is opened with O_NOFOLLOW, so a symlink (extracted earlier or already
+ * there) can't redirect members outside the current directory.
+ * Returns a descriptor of the directory (AT_FDCWD for a name without '/'),
+ * or -1 if an error occurs
+ */
+int open_parent_dir(minitar_ctx_t *ctx, char *path, char **base) {
+    int dir_fd = AT_FDCWD;
+    char *component = path;
+    char *slash;
+    while ((slash = strchr(component, '/')) != NULL) {
+        *slash = '\0';
+        if (component[0] != '\0' && strcmp(component, ".") != 0) {
+            if (mkdirat(dir_fd, component, 0777) != 0 && errno != EEXIST) {
+                minitar_perror(ctx, "Failed to create directory %s", path);
+            }
+            int next_fd = openat(dir_fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (next_fd == -1) {
+                minitar_perror(ctx, "Failed to open directory %s", path);
+            }
+            if (dir_fd != AT_FDCWD) {
+                close(dir_fd);
+            }
+            if (next_fd == -1) {
+                *slash = '/';
+                return -1;
+            }
+            dir_fd = next_fd;
+        }
+        *slash = '/';
+        component = slash + 1;
+    }
+    *base = component;
+    return dir_fd;
+}
+
+/*
+ * Write the data regions of the GNU sparse member 'member' from 'archive_fd'
+ * to 'fd' where its map puts them, leaving holes in between
+ * Returns 0 upon success, -1 upon error
+ */
+int extract_sparse(minitar_ctx_t *ctx, const tar_member_t *member, int archive_fd, int fd) {
+    const gnu_header_extra_t *gnu = (const gnu_header_extra_t *) member->header->prefix;
+    const char(*regions)[2][12] = gnu->sparse;
+    int num_regions = sizeof(gnu->sparse) / sizeof(gnu->sparse[0]);
+    int extended = gnu->isextended;
+    gnu_sparse_block_t block;
+    off_t block_offset = member->header_offset + BLOCK_SIZE;
+    off_t data_offset = member->payload_offset;
+    uint64_t data_left = member->size;
+    while (1) {
+        // The map ends at its first unused entry
+        for (int i = 0; i < num_regions && regions[i][0][0] != '\0'; i++) {
+            uint64_t offset, len;
+            if (tar_number_parse(regions[i][0], sizeof(regions[i][0]), &offset) != 0 ||
+                tar_number_parse(regions[i][1], sizeof(regions[i][1]), &len) != 0 ||
+                len > data_left || offset > INT64_MAX - len) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (lseek(fd, offset, SEEK_SET) == -1 ||
+                copy_archive_range(ctx, archive_fd, data_offset, fd, len) != 0) {
+                return -1;
+            }
+            data_offset += len;
+            data_left -= len;
+        }
+        if (!extended) {
+            break;
+        }
+        if (pread(archive_fd, &block, sizeof(block), block_offset) != sizeof(block)) {
+            errno = EINVAL;
+            return -1;
+        }
+        block_offset += BLOCK_SIZE;
+        regions = block.sparse;
+        num_regions = sizeof(block.sparse) / sizeof(block.sparse[0]);
+        extended = block.isextended;
+    }
+    return ftruncate(fd, member->real_size);
+}
+
+/*
+ * Create 'base' in 'dir_fd' as described by 'member', copying a regular
+ * file's payload from 'archive_fd'
+ * Returns 0 upon success, -1 upon error
+ */
+int extract_entry(minitar_ctx_t *ctx, const tar_member_t *member, int archive_fd, int dir_fd,
+                  const char *base, mode_t mode) {
+    const tar_header *header = member->header;
+    if (member->typeflag == DIRTYPE) {
+        return mkdirat(dir_fd, base, mode) == 0 || errno == EEXIST ? 0 : -1;
+    }
+
+    // Whatever is in the way goes first, so a later version of a name
+    // replaces an earlier one even if its type changed
+    if (unlinkat(dir_fd, base, 0) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    switch (member->typeflag) {
+    case REGTYPE:
+    case GNUTYPE_SPARSE: {
+        int fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, mode);
+        if (fd == -1) {
+            return -1;
+        }
+        int ret = member->typeflag == GNUTYPE_SPARSE
+                      ? extract_sparse(ctx, member, archive_fd, fd)
+                      : copy_archive_range(ctx, archive_fd, member->payload_offset, fd,
+                                           member->size);
+        if (close(fd) != 0) {
+            ret = -1;
+        }
+        return ret;
+    }
+    case SYMTYPE:
+        return symlinkat(member->linkname, dir_fd, base);
+    case CHRTYPE:
+    case BLKTYPE: {
+        uint64_t major, minor;
+        if (tar_number_parse(header->devmajor, sizeof(header->devmajor), &major) != 0 ||
+            tar_number_parse(header->devminor, sizeof(header->devminor), &minor) != 0 ||
+            major > UINT32_MAX || minor > UINT32_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        mode |= member->typeflag == CHRTYPE ? S_IFCHR : S_IFBLK;
+        return mknodat(dir_fd, base, mode, makedev(major, minor));
+    }
+    case FIFOTYPE:
+        return mkfifoat(dir_fd, base, mode);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+/*
+ * scan_archive callback that recreates each member below the current directory
+ */
+int extract_member(minitar_ctx_t *ctx, const tar_member_t *member, void *arg) {
+    extract_state_t *state = arg;
+    size_t name_len = member->name_len;
+    char name[PATH_MAX];
+    if (name_len >= sizeof(name)) {
+        minitar_error(ctx, "Name of member at offset %lld is too long to extract",
+                      (long long) member->start_offset);
+        state->failed = 1;
+        return 0;
+    }
+    memcpy(name, member->name, name_len);
+    // A trailing slash only marks a directory
+    while (name_len > 1 && name[name_len - 1] == '/') {
+        name_len--;
+    }
+    name[name_len] = '\0';
+    if (!extract_name_safe(name)) {
+        minitar_error(ctx, "Refusing to extract %s outside the current directory", name);
+        state->failed = 1;
+        return 0;
+    }
+
+    char *base;
+    int dir_fd = open_parent_dir(ctx, name, &base);
+    if (dir_fd == -1) {
+        state->failed = 1;
+        return 0;
+    }
+    mode_t mode = member->mode & 07777;
+    if (extract_entry(ctx, member, state->archive_fd, dir_fd, base, mode) != 0) {
+        // Devices can only be created with privileges, so like any other
+        // member that fails they are reported and skipped
+        minitar_perror(ctx, "Failed to extract %s", name);
+        state->failed = 1;
+    } else {
+        struct timespec times[2] = {
+            {0, UTIME_OMIT},
+            {member->mtime, 0},
+        };
+        utimensat(dir_fd, base, times, AT_SYMLINK_NOFOLLOW);
+    }
+    if (dir_fd != AT_FDCWD) {
+        close(dir_fd);
+    }
     return 0;
 }
+
+int extract_files_from_archive(minitar_ctx_t *ctx, const char *archive_name) {
+    extract_state_t state = {open(archive_name, O_RDONLY), 0};
+    if (state.archive_fd == -1) {
+        minitar_perror(ctx, "Failed to open archive file: %s", archive_name);
+        return -1;
+    }
+    int ret = scan_archive(ctx, archive_name, extract_member, &state);
+    close(state.archive_fd);
+    return ret == 0 && !state.failed ? 0 : -1;
+}
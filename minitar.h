@@ -2,7 +2,11 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "file_list.h"
+#include "minitar_ctx.h"
 
 // Standard tar header layout defined by POSIX
 typedef struct {
@@ -41,6 +45,65 @@ typedef struct {
     char padding[12];
 } tar_header;
 
+/*
+ * Every operation below takes the context 'ctx' as its first argument. Its
+ * options (ctx->opts, referred to as opts below) select the behavior, and
+ * errors are reported through it instead of being printed, see minitar_ctx.h.
+ */
+
+// A member as scan_archive hands it to callbacks, decoded from its own header
+// and the extension headers before it: GNU long names and link targets ('L'
+// and 'K') and PAX extended headers ('x', and 'g' for every later member).
+// Strings are null-terminated and, like 'header', only valid during the callback.
+typedef struct {
+    const tar_header *header;    // The member's own header block
+    off_t start_offset;          // Position of its first block, extension headers included
+    off_t header_offset;         // Position of 'header'
+    off_t payload_offset;        // Position of its content
+    const char *name;            // Full name, a ustar prefix included
+    size_t name_len;
+    const char *linkname;
+    size_t linkname_len;
+    const char *uname;
+    size_t uname_len;
+    uint64_t size;          // Bytes of content stored in the archive
+    uint64_t real_size;     // Size of the file, larger than 'size' for a GNU sparse member
+    long long mtime;
+    mode_t mode;
+    char typeflag;          // REGTYPE for any kind of regular file except a sparse one
+} tar_member_t;
+
+/*
+ * Called by scan_archive for every member in an archive.
+ * Return 0 to continue scanning, a positive value to stop early without error,
+ * or -1 to abort the scan with an error.
+ */
+typedef int (*member_callback_t)(minitar_ctx_t *ctx, const tar_member_t *member, void *arg);
+
+/*
+ * Walk the members of the archive identified by 'archive_name' in order,
+ * invoking 'callback' on each one.
+ * The format (ustar, GNU or PAX) is detected from the headers: how members
+ * are decoded is chosen from the first header, and an archive of plain ustar
+ * headers only switches to the decoder for extension headers once it meets one.
+ * GNU sparse members keep their type ('S'), PAX sparse files (GNU.sparse.*
+ * records) are reported as stored. Global PAX headers apply from where they are.
+ * Returns 0 upon reaching the end-of-archive marker (or an early stop requested
+ * by the callback) or -1 if an error occurred
+ */
+int scan_archive(minitar_ctx_t *ctx, const char *archive_name, member_callback_t callback,
+                 void *arg);
+
+/*
+ * Same as scan_archive, but start at the header at 'start_offset' instead of
+ * the beginning of the archive. The offset must be a multiple of the block size
+ * and the block there must carry a valid header checksum (or be the
+ * end-of-archive marker), so a stale or corrupted cursor is rejected.
+ * Global PAX headers before 'start_offset' are not seen.
+ */
+int scan_archive_from(minitar_ctx_t *ctx, const char *archive_name, off_t start_offset,
+                      member_callback_t callback, void *arg);
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files stored in the 'files' list.
@@ -48,9 +111,29 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * An 'archive_name' of "-" writes the archive to standard output instead.
+ * Symlinks, directories, FIFOs and device files become entries of their own
+ * type without a payload (directories are not descended into). With
+ * opts->dereference set, symlinks are followed and archived as their target.
+ * With opts->pipeline set, reader threads open and read members ahead and
+ * hand them to the calling thread, which writes them in list order.
  * This function should return 0 upon success or -1 if an error occurred
  */
-int create_archive(const char *archive_name, const file_list_t *files);
+int create_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *files);
+
+/*
+ * Split 'files' into opts->num_shards groups of roughly equal total size and
+ * create one archive from each group, up to opts->num_jobs at a time.
+ * Shard i of "NAME.tar" is named "NAME.i.tar" (other names get ".i" appended).
+ * Inputs are assigned largest first, each to the shard with the smallest total
+ * so far; a shard may end up empty when there are fewer files than shards.
+ * Each shard is built with its own child context (minitar_ctx_init_child).
+ * If opts->shard_manifest is set, it receives one tab-separated line per file:
+ *   shard archive name, member name, size
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int create_sharded_archives(minitar_ctx_t *ctx, const char *archive_name,
+                            const file_list_t *files);
 
 /*
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
@@ -58,7 +141,8 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * You may also assume that all files to be appended exist.
  * This function should return 0 upon success or -1 if an error occurred.
  */
-int append_files_to_archive(const char *archive_name, const file_list_t *files);
+int append_files_to_archive(minitar_ctx_t *ctx, const char *archive_name,
+                            const file_list_t *files);
 
 /*
  * Add the name of each file contained in the archive identified by 'archive_name'
@@ -67,7 +151,70 @@ int append_files_to_archive(const char *archive_name, const file_list_t *files);
  * operation, but think about how you can reuse it for the update operation.
  * This function should return 0 upon success or -1 if an error occurred.
  */
-int get_archive_file_list(const char *archive_name, file_list_t *files);
+int get_archive_file_list(minitar_ctx_t *ctx, const char *archive_name, file_list_t *files);
+
+/*
+ * Write a listing of the members of the archive identified by 'archive_name'
+ * to the file descriptor 'out_fd' in the format opts->list_format.
+ * Records are streamed as the headers are scanned through a large output buffer,
+ * so output begins immediately.
+ * Listing starts at opts->list_start_offset. If opts->list_limit members were
+ * listed and more remain, the header offset of the next one is stored in
+ * ctx->list_next_offset (otherwise -1); passing it back as the start offset lists the
+ * next page without rescanning the earlier ones. Generations are counted from
+ * the start offset, so they are only archive-wide on the first page.
+ * Every format except LIST_PLAIN reports these fields, in this order:
+ *   name, size, mtime, mode (octal), uname, header offset (of the member's
+ *   first header, extension headers included), payload offset,
+ *   generation (1 for the first member with a given name, 2 for the next, ...)
+ * LIST_PLAIN uses constant memory. The other formats keep one counter per
+ * distinct name to report generations.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int list_archive(minitar_ctx_t *ctx, const char *archive_name, int out_fd);
+
+/*
+ * List the 'num_archives' archives named in 'archive_names' to 'out_fd' like
+ * list_archive, using up to opts->num_jobs threads. Every record is tagged with
+ * the name of its archive: "ARCHIVE:NAME" for LIST_PLAIN, an extra leading
+ * field for LIST_TSV and LIST_NUL, and an "archive" key for LIST_JSONL.
+ * By default listings appear in the order of 'archive_names', each one whole.
+ * With opts->list_unordered they appear as soon as each archive is scanned,
+ * and a large listing may be interleaved with others in chunks of whole records.
+ * Paging (opts->list_start_offset and opts->list_limit) is not supported here.
+ * An archive that cannot be read is reported and skipped. Each archive is
+ * listed with its own child context, whose first error is merged into 'ctx'.
+ * This function should return 0 upon success or -1 if any archive failed.
+ */
+int list_archives(minitar_ctx_t *ctx, const char **archive_names, size_t num_archives,
+                  int out_fd);
+
+/*
+ * Compare the most recent version of every member of the archives 'archive_a'
+ * and 'archive_b' and write one line per difference to 'out_fd':
+ *   "A NAME" for a member only in 'archive_b',
+ *   "D NAME" for a member only in 'archive_a',
+ *   "M NAME" for a member whose contents or mode changed.
+ * Members are compared by header metadata first: a different size or mode is
+ * a modification and an identical size and mtime is not. Only members with
+ * the same size but a different mtime have their contents read and compared.
+ * This function should return 0 if the archives match, 1 if they differ
+ * or -1 if an error occurred.
+ */
+int diff_archives(minitar_ctx_t *ctx, const char *archive_a, const char *archive_b, int out_fd);
+
+/*
+ * Create the archive 'out_name' holding the members of the 'num_archives'
+ * archives named in 'archive_names', one version per name chosen according to
+ * opts->merge_policy (later versions within one input supersede earlier ones).
+ * Members appear in the order their names first occur across the inputs.
+ * Headers and payloads are copied from the inputs as they are, so the data
+ * never passes through this process where the kernel can copy it directly.
+ * The output may not be one of the inputs.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int merge_archives(minitar_ctx_t *ctx, const char *out_name, const char **archive_names,
+                   int num_archives);
 
 /*
  * Write each file contained within the archive identified by 'archive_name'
@@ -75,8 +222,25 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  * If there are multiple versions of the same file present in the archive,
  * then only the most recently added version should be present as a new file
  * at the end of the extraction process.
+ * Symlinks, directories, FIFOs and devices are recreated as such, GNU sparse
+ * files with their holes, and missing parent directories are created along
+ * the way. Members with an absolute name or a ".." component, or whose path
+ * would lead through a symlink, are refused. A member that can't be
+ * extracted (e.g. a device without the privilege to create it) is reported
+ * and skipped.
  * This function should return 0 upon success or -1 if an error occurred.
  */
-int extract_files_from_archive(const char *archive_name);
+int extract_files_from_archive(minitar_ctx_t *ctx, const char *archive_name);
+
+/*
+ * Check the archive identified by 'archive_name' against its Merkle sidecar.
+ * With an empty 'members' list every chunk of the archive is re-hashed in
+ * parallel. Otherwise only the chunks holding the most recent version of each
+ * named member are re-hashed and checked along their path to the root.
+ * Writes one "NAME: OK" or "NAME: FAILED" line per checked item to 'out_fd'.
+ * This function should return 0 if everything checked is intact or -1 otherwise.
+ */
+int verify_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *members,
+                   int out_fd);
 
 #endif    // _MINITAR_H
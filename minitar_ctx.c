@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "minitar_ctx.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void minitar_opts_init(minitar_opts_t *opts) {
+    opts->merkle = 0;
+    opts->num_jobs = 0;
+    opts->manifest_out = NULL;
+    opts->checkpoint_members = 0;
+    opts->checkpoint_bytes = 0;
+    opts->resume = 0;
+    opts->list_format = LIST_PLAIN;
+    opts->list_start_offset = 0;
+    opts->list_limit = 0;
+    opts->list_unordered = 0;
+    opts->merge_policy = MERGE_NEWEST;
+    opts->num_shards = 0;
+    opts->shard_manifest = NULL;
+    opts->memory_limit = 0;
+    opts->pipeline = 0;
+    opts->no_sync_stat = 0;
+    opts->dereference = 0;
+    opts->embed_index = 0;
+    memset(&opts->placement, 0, sizeof(opts->placement));
+}
+
+void minitar_ctx_init(minitar_ctx_t *ctx) {
+    minitar_opts_init(&ctx->opts);
+    ctx->allocator = minitar_default_allocator;
+    ctx->on_error = NULL;
+    ctx->on_error_arg = NULL;
+    ctx->error[0] = '\0';
+    ctx->has_error = 0;
+    name_map_init_with(&ctx->user_names, MINITAR_ID_NAME_LEN, &ctx->allocator);
+    name_map_init_with(&ctx->group_names, MINITAR_ID_NAME_LEN, &ctx->allocator);
+    ctx->pool = NULL;
+    ctx->owns_pool = 0;
+    ctx->fd_budget = NULL;
+    ctx->owns_fd_budget = 0;
+    ctx->list_next_offset = -1;
+}
+
+void minitar_ctx_init_child(minitar_ctx_t *child, const minitar_ctx_t *parent) {
+    minitar_ctx_init(child);
+    child->opts = parent->opts;
+    child->allocator = parent->allocator;
+    child->on_error = parent->on_error;
+    child->on_error_arg = parent->on_error_arg;
+    child->pool = parent->pool;
+    child->fd_budget = parent->fd_budget;
+}
+
+void minitar_ctx_merge_error(minitar_ctx_t *parent, const minitar_ctx_t *child) {
+    if (child->has_error && !parent->has_error) {
+        memcpy(parent->error, child->error, sizeof(parent->error));
+        parent->has_error = 1;
+    }
+}
+
+void minitar_ctx_free(minitar_ctx_t *ctx) {
+    name_map_clear(&ctx->user_names);
+    name_map_clear(&ctx->group_names);
+    if (ctx->owns_pool) {
+        buf_pool_free(ctx->pool);
+        minitar_free(ctx, ctx->pool);
+    }
+    ctx->pool = NULL;
+    ctx->owns_pool = 0;
+    if (ctx->owns_fd_budget) {
+        fd_budget_free(ctx->fd_budget);
+        minitar_free(ctx, ctx->fd_budget);
+    }
+    ctx->fd_budget = NULL;
+    ctx->owns_fd_budget = 0;
+}
+
+buf_pool_t *minitar_buffers(minitar_ctx_t *ctx) {
+    if (ctx->pool == NULL) {
+        ctx->pool = minitar_malloc(ctx, sizeof(buf_pool_t));
+        if (ctx->pool == NULL) {
+            return NULL;
+        }
+        buf_pool_init_limited(ctx->pool, &ctx->allocator, ctx->opts.memory_limit);
+        ctx->pool->per_node = ctx->opts.placement.numa;
+        ctx->owns_pool = 1;
+    }
+    return ctx->pool;
+}
+
+fd_budget_t *minitar_fd_budget(minitar_ctx_t *ctx) {
+    if (ctx->fd_budget == NULL) {
+        ctx->fd_budget = minitar_malloc(ctx, sizeof(fd_budget_t));
+        if (ctx->fd_budget == NULL) {
+            return NULL;
+        }
+        fd_budget_init(ctx->fd_budget);
+        ctx->owns_fd_budget = 1;
+    }
+    return ctx->fd_budget;
+}
+
+/*
+ * Record 'message' as the context's error unless an earlier one is already
+ * recorded, and pass it on to the error sink
+ */
+void report_error(minitar_ctx_t *ctx, const char *message) {
+    if (!ctx->has_error) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s", message);
+        ctx->has_error = 1;
+    }
+    if (ctx->on_error != NULL) {
+        ctx->on_error(ctx->on_error_arg, message);
+    }
+}
+
+void minitar_error(minitar_ctx_t *ctx, const char *format, ...) {
+    char message[MINITAR_ERR_LEN];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    report_error(ctx, message);
+}
+
+void minitar_perror(minitar_ctx_t *ctx, const char *format, ...) {
+    // Formatting may clobber errno, so describe it first
+    char description[128];
+    if (strerror_r(errno, description, sizeof(description)) != 0) {
+        snprintf(description, sizeof(description), "Unknown error %d", errno);
+    }
+
+    char message[MINITAR_ERR_LEN];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (len >= 0 && (size_t) len < sizeof(message)) {
+        snprintf(message + len, sizeof(message) - len, ": %s", description);
+    }
+    report_error(ctx, message);
+}
+
+const char *minitar_last_error(const minitar_ctx_t *ctx) {
+    return ctx->has_error ? ctx->error : NULL;
+}
+
+void minitar_clear_error(minitar_ctx_t *ctx) {
+    ctx->error[0] = '\0';
+    ctx->has_error = 0;
+}
+
+void *minitar_malloc(minitar_ctx_t *ctx, size_t size) {
+    return ctx->allocator.malloc_fn(ctx->allocator.arg, size);
+}
+
+void *minitar_calloc(minitar_ctx_t *ctx, size_t count, size_t size) {
+    if (size != 0 && count > (size_t) -1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = minitar_malloc(ctx, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *minitar_realloc(minitar_ctx_t *ctx, void *ptr, size_t size) {
+    return ctx->allocator.realloc_fn(ctx->allocator.arg, ptr, size);
+}
+
+void minitar_free(minitar_ctx_t *ctx, void *ptr) {
+    if (ptr != NULL) {
+        ctx->allocator.free_fn(ctx->allocator.arg, ptr);
+    }
+}
+
+int minitar_user_name(minitar_ctx_t *ctx, uid_t uid, char name[MINITAR_ID_NAME_LEN]) {
+    char key[24];
+    snprintf(key, sizeof(key), "%lu", (unsigned long) uid);
+    char *cached = name_map_get(&ctx->user_names, key);
+    if (cached == NULL) {
+        // Reentrant lookup, other contexts may be looking up names concurrently
+        char buf[4096];
+        struct passwd pwd_buf, *pwd = NULL;
+        int err = getpwuid_r(uid, &pwd_buf, buf, sizeof(buf), &pwd);
+        if (pwd == NULL) {
+            errno = err;
+            return -1;
+        }
+        if ((cached = name_map_put(&ctx->user_names, key, NULL)) == NULL) {
+            return -1;
+        }
+        strncpy(cached, pwd->pw_name, MINITAR_ID_NAME_LEN);
+    }
+    memcpy(name, cached, MINITAR_ID_NAME_LEN);
+    return 0;
+}
+
+int minitar_group_name(minitar_ctx_t *ctx, gid_t gid, char name[MINITAR_ID_NAME_LEN]) {
+    char key[24];
+    snprintf(key, sizeof(key), "%lu", (unsigned long) gid);
+    char *cached = name_map_get(&ctx->group_names, key);
+    if (cached == NULL) {
+        char buf[4096];
+        struct group grp_buf, *grp = NULL;
+        int err = getgrgid_r(gid, &grp_buf, buf, sizeof(buf), &grp);
+        if (grp == NULL) {
+            errno = err;
+            return -1;
+        }
+        if ((cached = name_map_put(&ctx->group_names, key, NULL)) == NULL) {
+            return -1;
+        }
+        strncpy(cached, grp->gr_name, MINITAR_ID_NAME_LEN);
+    }
+    memcpy(name, cached, MINITAR_ID_NAME_LEN);
+    return 0;
+}
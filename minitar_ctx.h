@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _MINITAR_CTX_H
+#define _MINITAR_CTX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "buf_pool.h"
+#include "fd_budget.h"
+#include "name_map.h"
+#include "parallel.h"
+
+// Output formats supported by list_archive
+typedef enum {
+    // One member name per line
+    LIST_PLAIN,
+    // One JSON object per line with every field below
+    LIST_JSONL,
+    // Tab-separated fields, one member per line. Tabs, newlines and
+    // backslashes inside names are escaped with a backslash as in C strings.
+    LIST_TSV,
+    // Same fields as LIST_TSV, but each field is terminated by a NUL byte
+    // instead and names are written verbatim
+    LIST_NUL,
+} list_format_t;
+
+// How merge_archives picks between versions of a name found in several inputs
+typedef enum {
+    // The version with the newest mtime, the later one on a tie
+    MERGE_NEWEST,
+    // The version from the input that comes last
+    MERGE_LAST,
+} merge_policy_t;
+
+// Options that modify how the archive operations below behave
+// Initialize with minitar_opts_init before setting individual fields
+typedef struct {
+    // Maintain a Merkle tree over the archive in a "<archive>.merkle" sidecar
+    // during create and append (append keeps an existing sidecar current regardless)
+    int merkle;
+    // Number of threads used by parallel operations, 0 means one per CPU
+    int num_jobs;
+    // If not NULL, write a sha256sum-compatible manifest of every member
+    // written by create/append to this file
+    const char *manifest_out;
+    // During create, durably record progress in "<archive>.ckpt" after every
+    // 'checkpoint_members' members and/or 'checkpoint_bytes' bytes (0 = never)
+    long checkpoint_members;
+    long long checkpoint_bytes;
+    // Continue an interrupted create from its last checkpoint. The same file
+    // list must be passed again; members before the checkpoint are skipped.
+    int resume;
+    // Output format of list_archive
+    list_format_t list_format;
+    // Header offset at which list_archive starts (a cursor from a previous
+    // page) and maximum number of members it lists (0 = no limit)
+    off_t list_start_offset;
+    long list_limit;
+    // Let list_archives write each archive's listing as soon as it is ready
+    // instead of in the order the archives were given
+    int list_unordered;
+    // Which version of a name merge_archives keeps
+    merge_policy_t merge_policy;
+    // Split create into this many archives of balanced total size, built
+    // concurrently (0 = a single archive), and optionally record which
+    // shard each member went to in 'shard_manifest'
+    int num_shards;
+    const char *shard_manifest;
+    // Cap on the bulk I/O buffers an operation (including all of its worker
+    // threads) holds at once, in bytes (0 = no limit). Threads that would go
+    // over it wait for a buffer to be returned instead.
+    size_t memory_limit;
+    // During create, read members on opts.num_jobs threads ahead of the one
+    // writing the archive, which still writes them strictly in list order
+    int pipeline;
+    // Let the stat calls behind new headers answer from attributes the
+    // kernel has cached (AT_STATX_DONT_SYNC) rather than revalidating them
+    // with the server first on network and FUSE filesystems
+    int no_sync_stat;
+    // Archive what symlinks point to instead of the links themselves
+    int dereference;
+    // During create, store an index of the members as a final member of the
+    // archive (append keeps an existing one current regardless)
+    int embed_index;
+    // Where worker threads run: pinned to a list of CPUs and/or spread over
+    // NUMA nodes, with bulk buffers kept on the node that first touched them
+    parallel_placement_t placement;
+} minitar_opts_t;
+
+// Fill 'opts' with the default behavior of every operation
+void minitar_opts_init(minitar_opts_t *opts);
+
+// Called with every error message an operation reports, e.g. to log it
+typedef void (*minitar_error_fn)(void *arg, const char *message);
+
+// Longest error message kept in a context, including the terminator
+#define MINITAR_ERR_LEN 256
+// Longest user or group name stored in a tar header, including the terminator
+#define MINITAR_ID_NAME_LEN 32
+
+// Everything an archive operation needs besides its arguments.
+// Operations never touch global state or write to stderr, so any number of
+// them can run at once as long as each thread uses its own context.
+// Initialize with minitar_ctx_init and release with minitar_ctx_free.
+// The caches point back into the context, so it must not be moved in between.
+typedef struct {
+    minitar_opts_t opts;
+    // Every allocation an operation makes goes through here. Operations also
+    // carve their short-lived headers, names and bookkeeping out of arenas
+    // fed by this allocator, which are released in one go when they finish.
+    // Replace it right after minitar_ctx_init, before the context is used.
+    minitar_allocator_t allocator;
+    // Optional error sink. The CLI prints to stderr here; embedders may log.
+    minitar_error_fn on_error;
+    void *on_error_arg;
+    // First error reported since initialization or minitar_clear_error
+    char error[MINITAR_ERR_LEN];
+    int has_error;
+    // uid -> user name and gid -> group name caches for header creation
+    name_map_t user_names;
+    name_map_t group_names;
+    // Bulk I/O buffers, created on first use by minitar_buffers and shared
+    // with child contexts
+    buf_pool_t *pool;
+    int owns_pool;
+    // File descriptor budget, created on first use by minitar_fd_budget and
+    // shared with child contexts
+    fd_budget_t *fd_budget;
+    int owns_fd_budget;
+    // Set by list_archive: header offset of the first member not listed
+    // because of opts.list_limit, or -1 if the listing reached the end
+    off_t list_next_offset;
+} minitar_ctx_t;
+
+// Prepare 'ctx' with default options, the C library allocator and no error sink
+void minitar_ctx_init(minitar_ctx_t *ctx);
+
+// Prepare 'child' for a worker thread of an operation running under 'parent':
+// same options, allocator, error sink, buffer pool and descriptor budget, but
+// its own caches and error state
+void minitar_ctx_init_child(minitar_ctx_t *child, const minitar_ctx_t *parent);
+
+// Carry the error recorded in 'child' (if any) over to 'parent'
+void minitar_ctx_merge_error(minitar_ctx_t *parent, const minitar_ctx_t *child);
+
+// Release the caches held by 'ctx'
+void minitar_ctx_free(minitar_ctx_t *ctx);
+
+// Report an error described by a printf-style format
+void minitar_error(minitar_ctx_t *ctx, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Report an error like perror: the message is followed by the description of errno
+void minitar_perror(minitar_ctx_t *ctx, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// The first error reported on 'ctx', or NULL if there was none
+const char *minitar_last_error(const minitar_ctx_t *ctx);
+
+// Forget the recorded error so the context can be reused
+void minitar_clear_error(minitar_ctx_t *ctx);
+
+// Allocation through the context's allocator, same contracts as the C library
+void *minitar_malloc(minitar_ctx_t *ctx, size_t size);
+void *minitar_calloc(minitar_ctx_t *ctx, size_t count, size_t size);
+void *minitar_realloc(minitar_ctx_t *ctx, void *ptr, size_t size);
+void minitar_free(minitar_ctx_t *ctx, void *ptr);
+
+// The pool of bulk I/O buffers, sized by opts.memory_limit on first use.
+// An operation that hands child contexts to worker threads must call this
+// before starting them, so they all draw from the same pool.
+// Returns NULL if the pool could not be allocated
+buf_pool_t *minitar_buffers(minitar_ctx_t *ctx);
+
+// The budget of file descriptors, sized by RLIMIT_NOFILE on first use. Like
+// minitar_buffers, it must be created before child contexts are handed out.
+// Returns NULL if the budget could not be allocated
+fd_budget_t *minitar_fd_budget(minitar_ctx_t *ctx);
+
+// Look up the name of user 'uid' / group 'gid' into 'name', caching the answer
+// Returns 0 on success or -1 (with errno set) if the id has no name
+int minitar_user_name(minitar_ctx_t *ctx, uid_t uid, char name[MINITAR_ID_NAME_LEN]);
+int minitar_group_name(minitar_ctx_t *ctx, gid_t gid, char name[MINITAR_ID_NAME_LEN]);
+
+#endif    // _MINITAR_CTX_H
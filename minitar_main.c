@@ -1,11 +1,28 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "file_list.h"
 #include "minitar.h"
+#include "watch.h"
 
-int update_archive(const char *archive_name, const file_list_t *files) {
+// Commands that are spelled like long options but take the place of -c, -t, etc.
+const char *long_commands[] = {"--verify", "--watch", "--diff-archives", "--merge", NULL};
+
+// Options consumed by main itself rather than stored in minitar_opts_t
+int debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+const char *archives_from = NULL;
+
+/*
+ * Error sink for the command line: every error goes to stderr as it happens
+ */
+void print_error(void *arg, const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+int update_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *files) {
     FILE *archive = fopen(archive_name, "rb");
     if (!archive) {
         printf("Failed to open archive file: %s", archive_name);
@@ -15,84 +32,382 @@ int update_archive(const char *archive_name, const file_list_t *files) {
 
     // creates file list for archive
     file_list_t archive_files;
-    file_list_init(&archive_files);
+    file_list_init_with(&archive_files, &ctx->allocator);
+    // Member names usually come in directory order and share long prefixes
+    archive_files.front_coded = 1;
 
     // fetches all files in archive
-    get_archive_file_list(archive_name, &archive_files);
-
-    // compares files from archive and files to update
-    node_t *archive_file = archive_files.head;
-    node_t *update_file = files->head;
-
-    while (update_file != NULL) {
-        // reset to head on each iteration
-        archive_file = archive_files.head;
-        int found = 0;
-
-        // iterate through archived files
-        while (archive_file != NULL) {
-            if (strcmp(archive_file->name, update_file->name) == 0) {
-                // File found in the archive
-                found = 1;
-                break;
-            }
-            archive_file = archive_file->next;
-        }
+    get_archive_file_list(ctx, archive_name, &archive_files);
 
+    // every file to update must already be in the archive
+    file_list_iter_t iter;
+    for (const char *name = file_list_first(files, &iter); name != NULL;
+         name = file_list_next(&iter)) {
         // if the file that needs to be updated is not found, return error
-        if (!found) {
+        if (!file_list_contains(&archive_files, name)) {
             fclose(archive);
             file_list_clear(&archive_files);
             printf("Error: One or more of the specified files is not already present in archive");
             return -1;
         }
-
-        // iterate to next file to update
-        update_file = update_file->next;
     }
     fclose(archive);
     file_list_clear(&archive_files);
 
-    return append_files_to_archive(archive_name, files);
+    return append_files_to_archive(ctx, archive_name, files);
+}
+
+/*
+ * Append a copy of 'name' to the array '*names' of '*num_names' entries
+ * Returns 0 on success or -1 if an error occurs
+ */
+int add_archive_name(char ***names, size_t *num_names, const char *name) {
+    char **new_names = realloc(*names, (*num_names + 1) * sizeof(char *));
+    if (new_names == NULL) {
+        perror("Failed to allocate archive list");
+        return -1;
+    }
+    *names = new_names;
+    if ((new_names[*num_names] = strdup(name)) == NULL) {
+        perror("Failed to allocate archive list");
+        return -1;
+    }
+    (*num_names)++;
+    return 0;
+}
+
+/*
+ * Add the archive names listed one per line in the file 'list_name' to the
+ * array '*names' of '*num_names' entries
+ * Returns 0 on success or -1 if an error occurs
+ */
+int read_archive_names(const char *list_name, char ***names, size_t *num_names) {
+    FILE *list = strcmp(list_name, "-") == 0 ? stdin : fopen(list_name, "r");
+    if (list == NULL) {
+        perror("Failed to open archive list");
+        return -1;
+    }
+
+    int ret = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, list)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (add_archive_name(names, num_names, line) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0 && ferror(list)) {
+        perror("Failed to read archive list");
+        ret = -1;
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+    return ret;
+}
+
+/*
+ * List every archive named after -f on the command line and in the
+ * --archives-from file, concurrently when there is more than one
+ * Returns 0 on success or -1 if an error occurs
+ */
+int list_command(int argc, char **argv, minitar_ctx_t *ctx) {
+    if (archives_from == NULL && argc == 4) {
+        int ret = list_archive(ctx, argv[3], STDOUT_FILENO);
+        if (ret == 0 && ctx->list_next_offset != -1) {
+            fprintf(stderr, "next_offset=%lld\n", (long long) ctx->list_next_offset);
+        }
+        return ret;
+    }
+
+    size_t num_names = 0;
+    char **names = NULL;
+    int ret = 0;
+    for (int i = 3; i < argc && ret == 0; i++) {
+        ret = add_archive_name(&names, &num_names, argv[i]);
+    }
+    if (ret == 0 && archives_from != NULL &&
+        read_archive_names(archives_from, &names, &num_names) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0 && (ctx->opts.list_start_offset != 0 || ctx->opts.list_limit != 0)) {
+        printf("--start-offset and --limit apply to a single archive only\n");
+        ret = -1;
+    } else if (ret == 0 && num_names > 0) {
+        ret = list_archives(ctx, (const char **) names, num_names, STDOUT_FILENO);
+    }
+
+    for (size_t i = 0; i < num_names; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/*
+ * Parse a byte count with an optional K, M or G suffix (powers of 1024)
+ * Returns 0 on success or -1 if 'arg' is not a positive size
+ */
+int parse_size(const char *arg, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (shift != 0) {
+        end++;
+    }
+    if (end == arg || *end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *size = (size_t) value << shift;
+    return 0;
+}
+
+/*
+ * Parse a long option of the form "--name" or "--name=value" into 'opts'
+ * Returns 1 if 'arg' was an option, 0 if it is a positional argument,
+ * or -1 if it is an unknown or malformed option
+ */
+int parse_option(const char *arg, minitar_opts_t *opts) {
+    if (strncmp(arg, "--", 2) != 0) {
+        return 0;
+    }
+    for (int i = 0; long_commands[i] != NULL; i++) {
+        if (strcmp(arg, long_commands[i]) == 0) {
+            return 0;
+        }
+    }
+
+    if (strcmp(arg, "--merkle") == 0) {
+        opts->merkle = 1;
+    } else if (strncmp(arg, "--jobs=", 7) == 0) {
+        char *end;
+        long jobs = strtol(arg + 7, &end, 10);
+        if (*end != '\0' || jobs < 1) {
+            printf("Invalid job count: %s\n", arg + 7);
+            return -1;
+        }
+        opts->num_jobs = (int) jobs;
+    } else if (strncmp(arg, "--manifest-out=", 15) == 0 && arg[15] != '\0') {
+        opts->manifest_out = arg + 15;
+    } else if (strncmp(arg, "--checkpoint=", 13) == 0) {
+        char *end;
+        long members = strtol(arg + 13, &end, 10);
+        if (*end != '\0' || members < 1) {
+            printf("Invalid checkpoint interval: %s\n", arg + 13);
+            return -1;
+        }
+        opts->checkpoint_members = members;
+    } else if (strncmp(arg, "--checkpoint-bytes=", 19) == 0) {
+        char *end;
+        long long bytes = strtoll(arg + 19, &end, 10);
+        if (*end != '\0' || bytes < 1) {
+            printf("Invalid checkpoint interval: %s\n", arg + 19);
+            return -1;
+        }
+        opts->checkpoint_bytes = bytes;
+    } else if (strcmp(arg, "--resume") == 0) {
+        opts->resume = 1;
+    } else if (strncmp(arg, "--debounce=", 11) == 0) {
+        char *end;
+        long ms = strtol(arg + 11, &end, 10);
+        if (*end != '\0' || ms < 1) {
+            printf("Invalid debounce interval: %s\n", arg + 11);
+            return -1;
+        }
+        debounce_ms = (int) ms;
+    } else if (strncmp(arg, "--format=", 9) == 0) {
+        const char *format = arg + 9;
+        if (strcmp(format, "plain") == 0) {
+            opts->list_format = LIST_PLAIN;
+        } else if (strcmp(format, "jsonl") == 0) {
+            opts->list_format = LIST_JSONL;
+        } else if (strcmp(format, "tsv") == 0) {
+            opts->list_format = LIST_TSV;
+        } else if (strcmp(format, "nul") == 0) {
+            opts->list_format = LIST_NUL;
+        } else {
+            printf("Unknown list format: %s\n", format);
+            return -1;
+        }
+    } else if (strncmp(arg, "--start-offset=", 15) == 0) {
+        char *end;
+        long long offset = strtoll(arg + 15, &end, 10);
+        if (*end != '\0' || offset < 0) {
+            printf("Invalid start offset: %s\n", arg + 15);
+            return -1;
+        }
+        opts->list_start_offset = offset;
+    } else if (strncmp(arg, "--limit=", 8) == 0) {
+        char *end;
+        long limit = strtol(arg + 8, &end, 10);
+        if (*end != '\0' || limit < 1) {
+            printf("Invalid limit: %s\n", arg + 8);
+            return -1;
+        }
+        opts->list_limit = limit;
+    } else if (strncmp(arg, "--archives-from=", 16) == 0 && arg[16] != '\0') {
+        archives_from = arg + 16;
+    } else if (strncmp(arg, "--shards=", 9) == 0) {
+        char *end;
+        long shards = strtol(arg + 9, &end, 10);
+        if (*end != '\0' || shards < 1 || shards > 1000000) {
+            printf("Invalid shard count: %s\n", arg + 9);
+            return -1;
+        }
+        opts->num_shards = (int) shards;
+    } else if (strncmp(arg, "--shard-manifest=", 17) == 0 && arg[17] != '\0') {
+        opts->shard_manifest = arg + 17;
+    } else if (strcmp(arg, "--merge-policy=newest") == 0) {
+        opts->merge_policy = MERGE_NEWEST;
+    } else if (strcmp(arg, "--merge-policy=last") == 0) {
+        opts->merge_policy = MERGE_LAST;
+    } else if (strncmp(arg, "--memory-limit=", 15) == 0) {
+        if (parse_size(arg + 15, &opts->memory_limit) != 0) {
+            printf("Invalid memory limit: %s\n", arg + 15);
+            return -1;
+        }
+    } else if (strcmp(arg, "--pipeline") == 0) {
+        opts->pipeline = 1;
+    } else if (strcmp(arg, "--dereference") == 0) {
+        opts->dereference = 1;
+    } else if (strcmp(arg, "--no-sync-stat") == 0) {
+        opts->no_sync_stat = 1;
+    } else if (strncmp(arg, "--cpus=", 7) == 0) {
+        if (parallel_parse_cpus(arg + 7, &opts->placement) != 0) {
+            printf("Invalid CPU list: %s\n", arg + 7);
+            return -1;
+        }
+    } else if (strcmp(arg, "--index") == 0) {
+        opts->embed_index = 1;
+    } else if (strcmp(arg, "--numa") == 0) {
+        opts->placement.numa = 1;
+    } else if (strcmp(arg, "--unordered") == 0) {
+        opts->list_unordered = 1;
+    } else {
+        printf("Unknown option: %s\n", arg);
+        return -1;
+    }
+    return 1;
 }
 
 int main(int argc, char **argv) {
-    if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+    minitar_ctx_t ctx;
+    minitar_ctx_init(&ctx);
+    ctx.on_error = print_error;
+
+    // Long options may appear anywhere, strip them so the positional layout
+    // below stays "CMD -f ARCHIVE [FILE...]"
+    int num_args = 1;
+    for (int i = 1; i < argc; i++) {
+        int ret = parse_option(argv[i], &ctx.opts);
+        if (ret < 0) {
+            return -1;
+        } else if (ret == 0) {
+            argv[num_args++] = argv[i];
+        }
+    }
+    argc = num_args;
+    // Without --jobs, one worker per CPU of --cpus rather than per online CPU
+    if (ctx.opts.num_jobs == 0 && parallel_placement_cpus(&ctx.opts.placement) > 0) {
+        ctx.opts.num_jobs = parallel_placement_cpus(&ctx.opts.placement);
+    }
+
+    // With --archives-from, -t needs no archive after -f (or even -f itself)
+    int list_only = archives_from != NULL && argc >= 2 && strcmp(argv[1], "-t") == 0;
+    if (argc < 4 && !list_only) {
+        printf("Usage: %s -c|a|t|u|x|--verify|--watch -f ARCHIVE [FILE...] [--merkle] [--jobs=N]\n"
+               "       [--manifest-out=FILE] [--checkpoint=N] [--checkpoint-bytes=N] [--resume]\n"
+               "       [--debounce=MS] [--format=plain|jsonl|tsv|nul] [--start-offset=OFF]\n"
+               "       [--limit=N] [--archives-from=FILE] [--unordered] [--shards=N]\n"
+               "       [--shard-manifest=FILE] [--memory-limit=SIZE[K|M|G]] [--pipeline]\n"
+               "       [--no-sync-stat] [--dereference] [--cpus=LIST] [--numa] [--index]\n"
+               "       %s --diff-archives [-f] ARCHIVE_A ARCHIVE_B\n"
+               "       %s --merge [-f] OUT ARCHIVE... [--merge-policy=newest|last]\n",
+               argv[0], argv[0], argv[0]);
         return 0;
     }
 
+    char *cmd = argv[1];
+    int ret = 0;
+    if (strcmp(cmd, "--diff-archives") == 0) {
+        // Both archives follow the command, with or without -f in between
+        int first = strcmp(argv[2], "-f") == 0 ? 3 : 2;
+        if (argc != first + 2) {
+            printf("--diff-archives takes exactly two archives\n");
+            ret = 2;
+        } else {
+            // Exit status as for diff(1): 0 = same, 1 = different, 2 = trouble
+            ret = diff_archives(&ctx, argv[first], argv[first + 1], STDOUT_FILENO);
+            ret = ret == -1 ? 2 : ret;
+        }
+        minitar_ctx_free(&ctx);
+        return ret;
+    } else if (strcmp(cmd, "--merge") == 0) {
+        int first = strcmp(argv[2], "-f") == 0 ? 3 : 2;
+        if (argc < first + 2) {
+            printf("--merge needs an output archive and at least one input\n");
+            ret = -1;
+        } else {
+            ret = merge_archives(&ctx, argv[first], (const char **) argv + first + 1,
+                                 argc - first - 1);
+        }
+        minitar_ctx_free(&ctx);
+        return ret == 0 ? 0 : 1;
+    } else if (strcmp(cmd, "-t") == 0) {
+        // Everything after -f names an archive to list
+        ret = list_command(argc, argv, &ctx) == 0 ? 0 : 1;
+        minitar_ctx_free(&ctx);
+        return ret;
+    }
+
     file_list_t files;
     file_list_init(&files);
 
-    char *cmd = argv[1];
     char *archive_name = argv[3];
 
     for (int i = 4; i < argc; i++) {
         file_list_add(&files, argv[i]);
     }
 
-    if (strcmp(cmd, "-c") == 0) {
-        create_archive(archive_name, &files);
+    if (strcmp(cmd, "-c") == 0 && ctx.opts.num_shards > 0) {
+        create_sharded_archives(&ctx, archive_name, &files);
+    } else if (strcmp(cmd, "-c") == 0) {
+        create_archive(&ctx, archive_name, &files);
     } else if (strcmp(cmd, "-a") == 0) {
-        append_files_to_archive(archive_name, &files);
-    } else if (strcmp(cmd, "-t") == 0) {
-        get_archive_file_list(archive_name, &files);
-        node_t *curr = files.head;
-        for (int i = 0; i < files.size; i++) {
-            printf("%s\n", curr->name);
-            curr = curr->next;
-        }
+        append_files_to_archive(&ctx, archive_name, &files);
     } else if (strcmp(cmd, "-u") == 0) {
-        update_archive(archive_name, &files);
+        update_archive(&ctx, archive_name, &files);
     } else if (strcmp(cmd, "-x") == 0) {
-        extract_files_from_archive(archive_name);
+        // A member that failed to extract fails the command, as for --verify
+        ret = extract_files_from_archive(&ctx, archive_name) == 0 ? 0 : 1;
+    } else if (strcmp(cmd, "--verify") == 0) {
+        // Unlike -c, -a and -u, report the verification result to the shell
+        ret = verify_archive(&ctx, archive_name, &files, STDOUT_FILENO) == 0 ? 0 : 1;
+    } else if (strcmp(cmd, "--watch") == 0) {
+        ret = watch_archive(&ctx, archive_name, &files, debounce_ms) == 0 ? 0 : 1;
     } else {
         printf("Unknown command: %s\n", cmd);
-        file_list_clear(&files);
-        return -1;
+        ret = -1;
     }
 
     file_list_clear(&files);
-    return 0;
+    minitar_ctx_free(&ctx);
+    return ret;
 }
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "name_map.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define INITIAL_SLOTS 64
+
+/*
+ * 64-bit FNV-1a hash of a null-terminated string
+ */
+uint64_t name_hash(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void name_map_init(name_map_t *map, size_t value_size) {
+    name_map_init_with(map, value_size, &minitar_default_allocator);
+}
+
+void name_map_init_with(name_map_t *map, size_t value_size, const minitar_allocator_t *allocator) {
+    map->value_size = value_size;
+    map->allocator = allocator;
+    arena_init(&map->key_arena, allocator);
+    map->keys = NULL;
+    map->values = NULL;
+    map->count = 0;
+    map->entries_cap = 0;
+    map->slots = NULL;
+    map->num_slots = 0;
+}
+
+/*
+ * Find the slot holding 'name', or the empty slot where it would be inserted
+ */
+size_t name_map_find_slot(const name_map_t *map, const char *name) {
+    size_t mask = map->num_slots - 1;
+    size_t slot = name_hash(name) & mask;
+    while (map->slots[slot] != 0 && strcmp(map->keys[map->slots[slot] - 1], name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void *name_map_get(const name_map_t *map, const char *name) {
+    if (map->num_slots == 0) {
+        return NULL;
+    }
+    size_t entry = map->slots[name_map_find_slot(map, name)];
+    return entry == 0 ? NULL : map->values + (entry - 1) * map->value_size;
+}
+
+/*
+ * Double the slot table and re-insert every entry
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+int name_map_grow_slots(name_map_t *map) {
+    size_t new_num_slots = map->num_slots == 0 ? INITIAL_SLOTS : map->num_slots * 2;
+    const minitar_allocator_t *allocator = map->allocator;
+    size_t *new_slots = allocator->malloc_fn(allocator->arg, new_num_slots * sizeof(size_t));
+    if (new_slots == NULL) {
+        return -1;
+    }
+    memset(new_slots, 0, new_num_slots * sizeof(size_t));
+    allocator->free_fn(allocator->arg, map->slots);
+    map->slots = new_slots;
+    map->num_slots = new_num_slots;
+    for (size_t i = 0; i < map->count; i++) {
+        map->slots[name_map_find_slot(map, map->keys[i])] = i + 1;
+    }
+    return 0;
+}
+
+void *name_map_put(name_map_t *map, const char *name, int *created) {
+    if (created != NULL) {
+        *created = 0;
+    }
+    // Keep the table at most half full so probe sequences stay short
+    if ((map->count + 1) * 2 > map->num_slots && name_map_grow_slots(map) != 0) {
+        return NULL;
+    }
+
+    size_t slot = name_map_find_slot(map, name);
+    if (map->slots[slot] != 0) {
+        return map->values + (map->slots[slot] - 1) * map->value_size;
+    }
+
+    if (map->count == map->entries_cap) {
+        size_t new_cap = map->entries_cap == 0 ? INITIAL_SLOTS : map->entries_cap * 2;
+        const minitar_allocator_t *allocator = map->allocator;
+        char **new_keys =
+            allocator->realloc_fn(allocator->arg, map->keys, new_cap * sizeof(char *));
+        if (new_keys == NULL) {
+            return NULL;
+        }
+        map->keys = new_keys;
+        char *new_values =
+            allocator->realloc_fn(allocator->arg, map->values, new_cap * map->value_size);
+        if (new_values == NULL) {
+            return NULL;
+        }
+        map->values = new_values;
+        map->entries_cap = new_cap;
+    }
+
+    char *key = arena_strdup(&map->key_arena, name);
+    if (key == NULL) {
+        return NULL;
+    }
+    map->keys[map->count] = key;
+    void *value = map->values + map->count * map->value_size;
+    memset(value, 0, map->value_size);
+    map->count++;
+    map->slots[slot] = map->count;
+    if (created != NULL) {
+        *created = 1;
+    }
+    return value;
+}
+
+const char *name_map_key(const name_map_t *map, size_t index) {
+    return map->keys[index];
+}
+
+void *name_map_value(const name_map_t *map, size_t index) {
+    return map->values + index * map->value_size;
+}
+
+void name_map_clear(name_map_t *map) {
+    const minitar_allocator_t *allocator = map->allocator;
+    arena_free(&map->key_arena);
+    allocator->free_fn(allocator->arg, map->keys);
+    allocator->free_fn(allocator->arg, map->values);
+    allocator->free_fn(allocator->arg, map->slots);
+    name_map_init_with(map, map->value_size, allocator);
+}
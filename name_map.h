@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _NAME_MAP_H
+#define _NAME_MAP_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+// Hash map from member names to fixed-size values.
+// Entries are also kept in insertion order so they can be walked by index.
+typedef struct {
+    size_t value_size;
+    const minitar_allocator_t *allocator;
+    arena_t key_arena;    // Holds every key, so they are freed all at once
+    char **keys;          // Entry keys, in insertion order
+    char *values;         // Entry values, 'value_size' bytes each, same order
+    size_t count;
+    size_t entries_cap;
+    size_t *slots;        // Open-addressed table of entry index + 1, 0 = empty
+    size_t num_slots;
+} name_map_t;
+
+// Initialize an empty map whose values are 'value_size' bytes each
+void name_map_init(name_map_t *map, size_t value_size);
+
+// Same as name_map_init, but memory comes from 'allocator', which must outlive the map
+void name_map_init_with(name_map_t *map, size_t value_size, const minitar_allocator_t *allocator);
+
+// Look up 'name'. Returns a pointer to its value or NULL if it is not present
+void *name_map_get(const name_map_t *map, const char *name);
+
+// Look up 'name', inserting it with an all-zero value if it is not present.
+// '*created' (if not NULL) is set to 1 when a new entry was inserted.
+// The returned pointer is only valid until the next insertion.
+// Returns NULL if memory could not be allocated
+void *name_map_put(name_map_t *map, const char *name, int *created);
+
+// Access the entry inserted 'index'-th (0 <= index < map->count)
+const char *name_map_key(const name_map_t *map, size_t index);
+void *name_map_value(const name_map_t *map, size_t index);
+
+// Remove all entries and free any memory associated with them
+void name_map_clear(name_map_t *map);
+
+#endif    // _NAME_MAP_H
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "ordered_queue.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Whether a counter at 'value' has reached 'target', allowing for wraparound
+ */
+int seq_reached(uint32_t value, uint32_t target) {
+    return (int32_t) (value - target) >= 0;
+}
+
+void seq_counter_init(seq_counter_t *counter, uint32_t value) {
+    counter->value = value;
+    counter->waiters = 0;
+}
+
+uint32_t seq_counter_get(seq_counter_t *counter) {
+    return __atomic_load_n(&counter->value, __ATOMIC_ACQUIRE);
+}
+
+void seq_counter_set(seq_counter_t *counter, uint32_t value) {
+    // Sequentially consistent together with the waiter count, so either the
+    // waiter sees the new value or this sees the waiter
+    __atomic_store_n(&counter->value, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&counter->waiters, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, &counter->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+int seq_counter_wait(seq_counter_t *counter, uint32_t target, const int *stop) {
+    if (seq_reached(seq_counter_get(counter), target) &&
+        (stop == NULL || !__atomic_load_n(stop, __ATOMIC_ACQUIRE))) {
+        return 0;
+    }
+    for (;;) {
+        __atomic_add_fetch(&counter->waiters, 1, __ATOMIC_SEQ_CST);
+        // The value is read before the stop flag: a stop after this point
+        // changes the value, so the futex won't sleep on the stale one
+        uint32_t value = __atomic_load_n(&counter->value, __ATOMIC_SEQ_CST);
+        int ret = 1;
+        if (stop != NULL && __atomic_load_n(stop, __ATOMIC_SEQ_CST)) {
+            ret = -1;
+        } else if (seq_reached(value, target)) {
+            ret = 0;
+        } else {
+            syscall(SYS_futex, &counter->value, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+        }
+        __atomic_sub_fetch(&counter->waiters, 1, __ATOMIC_SEQ_CST);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+}
+
+void seq_counter_interrupt(seq_counter_t *counter) {
+    __atomic_add_fetch(&counter->value, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &counter->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int ordered_queue_init(ordered_queue_t *queue, const minitar_allocator_t *allocator,
+                       size_t window) {
+    queue->window = window < 2 ? 2 : window;
+    queue->stop = 0;
+    queue->stages = allocator->malloc_fn(allocator->arg, queue->window * sizeof(seq_counter_t));
+    if (queue->stages == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < queue->window; i++) {
+        seq_counter_init(&queue->stages[i], 0);
+    }
+    return 0;
+}
+
+/*
+ * The stage slot 'seq' % window is in while it is free for item 'seq'
+ */
+uint32_t free_stage(const ordered_queue_t *queue, uint64_t seq) {
+    return (uint32_t) (seq / queue->window) * 2;
+}
+
+int ordered_queue_claim(ordered_queue_t *queue, uint64_t seq) {
+    return seq_counter_wait(&queue->stages[seq % queue->window], free_stage(queue, seq),
+                            &queue->stop);
+}
+
+void ordered_queue_publish(ordered_queue_t *queue, uint64_t seq) {
+    seq_counter_set(&queue->stages[seq % queue->window], free_stage(queue, seq) + 1);
+}
+
+int ordered_queue_wait(ordered_queue_t *queue, uint64_t seq) {
+    return seq_counter_wait(&queue->stages[seq % queue->window], free_stage(queue, seq) + 1,
+                            &queue->stop);
+}
+
+void ordered_queue_release(ordered_queue_t *queue, uint64_t seq) {
+    seq_counter_set(&queue->stages[seq % queue->window], free_stage(queue, seq) + 2);
+}
+
+void ordered_queue_stop(ordered_queue_t *queue) {
+    __atomic_store_n(&queue->stop, 1, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < queue->window; i++) {
+        seq_counter_interrupt(&queue->stages[i]);
+    }
+}
+
+void ordered_queue_free(ordered_queue_t *queue, const minitar_allocator_t *allocator) {
+    allocator->free_fn(allocator->arg, queue->stages);
+    queue->stages = NULL;
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _ORDERED_QUEUE_H
+#define _ORDERED_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// 32-bit counter that only moves forward (wrapping around) and that threads
+// can sleep on until it reaches a target. Updates are single atomic stores;
+// the futex behind it is only touched while somebody is waiting.
+typedef struct {
+    uint32_t value;
+    uint32_t waiters;
+} seq_counter_t;
+
+// Start 'counter' at 'value', before any other thread can see it
+void seq_counter_init(seq_counter_t *counter, uint32_t value);
+
+// The counter's current value
+uint32_t seq_counter_get(seq_counter_t *counter);
+
+// Move the counter to 'value', making everything written before visible to
+// threads that see the new value, and wake those waiting on it
+void seq_counter_set(seq_counter_t *counter, uint32_t value);
+
+// Sleep until 'counter' has reached 'target' or '*stop' is set (if 'stop' is not NULL)
+// Returns 0 once the target is reached or -1 if stopped
+int seq_counter_wait(seq_counter_t *counter, uint32_t target, const int *stop);
+
+// Wake every thread sleeping on 'counter' after their stop flag was set.
+// The counter's value is meaningless afterwards.
+void seq_counter_interrupt(seq_counter_t *counter);
+
+// Reorder window between producers finishing items in any order and a single
+// consumer taking them strictly by sequence number, without locks.
+// Item 'seq' lives in slot seq % window. Its producer claims the slot once the
+// consumer has released item seq - window, fills in whatever the caller keeps
+// per slot and publishes it; the consumer waits for each item in turn and
+// releases its slot when done with it. Since at most 'window' items are in
+// flight, producers can't run arbitrarily far ahead of the consumer.
+// Sequence numbers start at 0.
+typedef struct {
+    size_t window;
+    seq_counter_t *stages;    // Per slot: twice the generation of its item, +1 once published
+    int stop;                 // Set by ordered_queue_stop
+} ordered_queue_t;
+
+// Prepare a queue of 'window' (at least 2) slots allocated from 'allocator'
+// Returns 0 on success or -1 if memory could not be allocated
+int ordered_queue_init(ordered_queue_t *queue, const minitar_allocator_t *allocator,
+                       size_t window);
+
+// Producer: wait until the slot of item 'seq' is free for it
+// Returns 0 once it is or -1 if the queue was stopped
+int ordered_queue_claim(ordered_queue_t *queue, uint64_t seq);
+
+// Producer: hand the claimed item 'seq' over to the consumer
+void ordered_queue_publish(ordered_queue_t *queue, uint64_t seq);
+
+// Consumer: wait until item 'seq' has been published
+// Returns 0 once it is or -1 if the queue was stopped
+int ordered_queue_wait(ordered_queue_t *queue, uint64_t seq);
+
+// Consumer: give the slot of item 'seq' to item seq + window
+void ordered_queue_release(ordered_queue_t *queue, uint64_t seq);
+
+// Make every current and future claim or wait fail, e.g. after an error
+void ordered_queue_stop(ordered_queue_t *queue);
+
+// Release the queue's memory. No thread may be using it any more.
+void ordered_queue_free(ordered_queue_t *queue, const minitar_allocator_t *allocator);
+
+#endif    // _ORDERED_QUEUE_H
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "out_buf.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+int out_buf_init(out_buf_t *out, int fd, const minitar_allocator_t *allocator) {
+    out->fd = fd;
+    out->allocator = allocator;
+    out->len = 0;
+    out->cap = fd == -1 ? OUT_BUF_MEMORY_SIZE : OUT_BUF_SIZE;
+    out->data = allocator->malloc_fn(allocator->arg, out->cap);
+    return out->data == NULL ? -1 : 0;
+}
+
+int out_buf_drain_to(out_buf_t *out, int fd) {
+    size_t written = 0;
+    while (written < out->len) {
+        ssize_t ret = write(fd, out->data + written, out->len - written);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += ret;
+    }
+    out->len = 0;
+    return 0;
+}
+
+int out_buf_flush(out_buf_t *out) {
+    if (out->fd == -1) {
+        // In-memory buffers make room by growing instead
+        const minitar_allocator_t *allocator = out->allocator;
+        char *new_data = allocator->realloc_fn(allocator->arg, out->data, out->cap * 2);
+        if (new_data == NULL) {
+            return -1;
+        }
+        out->data = new_data;
+        out->cap *= 2;
+        return 0;
+    }
+    return out_buf_drain_to(out, out->fd);
+}
+
+int out_buf_write(out_buf_t *out, const void *data, size_t len) {
+    const char *bytes = data;
+    while (len > 0) {
+        if (out->len == out->cap && out_buf_flush(out) != 0) {
+            return -1;
+        }
+        size_t take = out->cap - out->len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(out->data + out->len, bytes, take);
+        out->len += take;
+        bytes += take;
+        len -= take;
+    }
+    return 0;
+}
+
+int out_buf_putc(out_buf_t *out, char c) {
+    if (out->len == out->cap && out_buf_flush(out) != 0) {
+        return -1;
+    }
+    out->data[out->len++] = c;
+    return 0;
+}
+
+void out_buf_free(out_buf_t *out) {
+    out->allocator->free_fn(out->allocator->arg, out->data);
+    out->data = NULL;
+    out->len = 0;
+}
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _OUT_BUF_H
+#define _OUT_BUF_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+// Size of the buffer used when streaming output to a file descriptor
+#define OUT_BUF_SIZE (256 * 1024)
+// Initial size of a buffer that collects output in memory
+#define OUT_BUF_MEMORY_SIZE (4 * 1024)
+
+// Buffered writer that sends large blocks straight to a file descriptor with
+// write(), bypassing stdio and its per-call locking.
+// With a file descriptor of -1 output is collected in memory instead, growing
+// the buffer as needed, until it is handed off with out_buf_drain_to.
+typedef struct {
+    int fd;
+    const minitar_allocator_t *allocator;
+    char *data;
+    size_t len;
+    size_t cap;
+} out_buf_t;
+
+// Prepare 'out' to write to 'fd', with its buffer taken from 'allocator'
+// (which must outlive 'out')
+// Returns 0 on success or -1 if the buffer could not be allocated
+int out_buf_init(out_buf_t *out, int fd, const minitar_allocator_t *allocator);
+
+// Append 'len' bytes from 'data', flushing whenever the buffer fills up
+// Returns 0 on success or -1 if a write fails
+int out_buf_write(out_buf_t *out, const void *data, size_t len);
+
+// Append a single byte
+// Returns 0 on success or -1 if a write fails
+int out_buf_putc(out_buf_t *out, char c);
+
+// Write out everything buffered so far
+// Returns 0 on success or -1 if a write fails
+int out_buf_flush(out_buf_t *out);
+
+// Write everything buffered so far to 'fd' (whatever 'out' was created with)
+// Returns 0 on success or -1 if a write fails
+int out_buf_drain_to(out_buf_t *out, int fd);
+
+// Release the buffer (without flushing it)
+void out_buf_free(out_buf_t *out);
+
+#endif    // _OUT_BUF_H
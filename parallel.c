@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "parallel.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// One "nodeN" directory per NUMA node, each with a "cpulist" file
+#define NUMA_NODE_DIR "/sys/devices/system/node"
+// Most NUMA nodes workers are spread over
+#define PARALLEL_MAX_NODES 64
+
+typedef struct {
+    size_t next_index;    // Next unclaimed item, shared by all workers
+    size_t num_items;
+    parallel_work_fn work;
+    void *arg;
+    const parallel_placement_t *placement;    // NULL to leave workers unpinned
+} parallel_job_t;
+
+typedef struct {
+    parallel_job_t *job;
+    int worker;
+} parallel_worker_t;
+
+int parallel_default_jobs(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+int parallel_parse_cpus(const char *list, parallel_placement_t *placement) {
+    memset(placement->cpus, 0, sizeof(placement->cpus));
+    const char *p = list;
+    for (;;) {
+        char *end;
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            if (end[1] < '0' || end[1] > '9') {
+                return -1;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= PARALLEL_MAX_CPUS) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            placement->cpus[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+        }
+        if (*end == '\0') {
+            return 0;
+        } else if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+int parallel_placement_cpus(const parallel_placement_t *placement) {
+    int count = 0;
+    for (int i = 0; i < PARALLEL_MAX_CPUS / 64; i++) {
+        count += __builtin_popcountll(placement->cpus[i]);
+    }
+    return count;
+}
+
+/*
+ * Read the CPUs of NUMA node 'node' into 'cpus', leaving only those also in
+ * 'allowed' if any of its bits are set
+ * Returns the number of CPUs left, or -1 if the node doesn't exist
+ */
+int numa_node_cpus(int node, const uint64_t *allowed, int any_allowed, uint64_t *cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), NUMA_NODE_DIR "/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[4096];
+    if (fgets(line, sizeof(line), file) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+
+    // A node with memory but no CPUs has an empty list
+    parallel_placement_t node_cpus;
+    if (parallel_parse_cpus(line, &node_cpus) != 0) {
+        memset(node_cpus.cpus, 0, sizeof(node_cpus.cpus));
+    }
+    int count = 0;
+    for (int i = 0; i < PARALLEL_MAX_CPUS / 64; i++) {
+        cpus[i] = any_allowed ? node_cpus.cpus[i] & allowed[i] : node_cpus.cpus[i];
+        count += __builtin_popcountll(cpus[i]);
+    }
+    return count;
+}
+
+/*
+ * The CPUs of the NUMA node 'worker' lands on when workers are dealt out
+ * round robin over the nodes that have CPUs 'placement' allows
+ * Returns 0 on success or -1 if no such node is known
+ */
+int numa_worker_cpus(const parallel_placement_t *placement, int worker, uint64_t *cpus) {
+    DIR *dir = opendir(NUMA_NODE_DIR);
+    if (dir == NULL) {
+        return -1;
+    }
+    int max_node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) == 1 && node > max_node) {
+            max_node = node;
+        }
+    }
+    closedir(dir);
+
+    int any_allowed = parallel_placement_cpus(placement) > 0;
+    int usable[PARALLEL_MAX_NODES];
+    int num_usable = 0;
+    uint64_t node_cpus[PARALLEL_MAX_CPUS / 64];
+    for (int node = 0; node <= max_node && num_usable < PARALLEL_MAX_NODES; node++) {
+        if (numa_node_cpus(node, placement->cpus, any_allowed, node_cpus) > 0) {
+            usable[num_usable++] = node;
+        }
+    }
+    if (num_usable == 0) {
+        return -1;
+    }
+    numa_node_cpus(usable[worker % num_usable], placement->cpus, any_allowed, cpus);
+    return 0;
+}
+
+int parallel_place_worker(const parallel_placement_t *placement, int worker) {
+    uint64_t cpus[PARALLEL_MAX_CPUS / 64];
+    int num_cpus = parallel_placement_cpus(placement);
+    if (placement->numa && numa_worker_cpus(placement, worker, cpus) == 0) {
+        // Pinned to the whole node, the scheduler still balances within it
+    } else if (num_cpus > 0) {
+        // Worker 'worker' gets the (worker % num_cpus)-th CPU of the list
+        int skip = worker % num_cpus;
+        memset(cpus, 0, sizeof(cpus));
+        for (int cpu = 0; cpu < PARALLEL_MAX_CPUS; cpu++) {
+            if ((placement->cpus[cpu / 64] >> (cpu % 64) & 1) && skip-- == 0) {
+                cpus[cpu / 64] = (uint64_t) 1 << (cpu % 64);
+                break;
+            }
+        }
+    } else {
+        return 0;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < PARALLEL_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (cpus[cpu / 64] >> (cpu % 64) & 1) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void *parallel_worker_main(void *arg) {
+    parallel_worker_t *self = arg;
+    parallel_job_t *job = self->job;
+    // Pinning is best effort: a worker that can't be placed still works
+    if (job->placement != NULL) {
+        parallel_place_worker(job->placement, self->worker);
+    }
+    while (1) {
+        size_t index = __atomic_fetch_add(&job->next_index, 1, __ATOMIC_RELAXED);
+        if (index >= job->num_items) {
+            break;
+        }
+        job->work(index, self->worker, job->arg);
+    }
+    return NULL;
+}
+
+int parallel_for(int num_jobs, size_t num_items, parallel_work_fn work, void *arg) {
+    return parallel_for_placed(NULL, num_jobs, num_items, work, arg);
+}
+
+int parallel_for_placed(const parallel_placement_t *placement, int num_jobs, size_t num_items,
+                        parallel_work_fn work, void *arg) {
+    if (num_jobs <= 0) {
+        num_jobs = parallel_default_jobs();
+    }
+    if ((size_t) num_jobs > num_items) {
+        num_jobs = (int) num_items;
+    }
+
+    if (placement != NULL && !placement->numa && parallel_placement_cpus(placement) == 0) {
+        placement = NULL;
+    }
+    parallel_job_t job = {0, num_items, work, arg, placement};
+    // The calling thread is pinned too while it works, and let go afterwards
+    cpu_set_t saved;
+    int restore = placement != NULL &&
+                  pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0;
+    if (num_jobs <= 1) {
+        parallel_worker_t self = {&job, 0};
+        parallel_worker_main(&self);
+        if (restore) {
+            pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        }
+        return 0;
+    }
+
+    pthread_t *threads = malloc(num_jobs * sizeof(pthread_t));
+    parallel_worker_t *workers = malloc(num_jobs * sizeof(parallel_worker_t));
+    if (threads == NULL || workers == NULL) {
+        free(threads);
+        free(workers);
+        return -1;
+    }
+
+    // The calling thread acts as worker 0, so only num_jobs - 1 are spawned
+    int started = 1;
+    for (; started < num_jobs; started++) {
+        workers[started].job = &job;
+        workers[started].worker = started;
+        if (pthread_create(&threads[started], NULL, parallel_worker_main, &workers[started]) !=
+            0) {
+            break;
+        }
+    }
+    workers[0].job = &job;
+    workers[0].worker = 0;
+    parallel_worker_main(&workers[0]);
+    if (restore) {
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Highest CPU number a placement can name, plus one
+#define PARALLEL_MAX_CPUS 1024
+
+// Where worker threads run. All zero leaves them to the scheduler.
+typedef struct {
+    // CPUs workers are pinned to, one bit each (none set = any CPU)
+    uint64_t cpus[PARALLEL_MAX_CPUS / 64];
+    // Spread workers over the NUMA nodes round robin and pin each to the CPUs
+    // of its node (those in 'cpus' if any are set), so the memory it touches
+    // first is allocated on that node
+    int numa;
+} parallel_placement_t;
+
+// Work function run by parallel_for for each item
+// 'worker' identifies the calling thread (0 <= worker < number of threads used)
+// so callers can keep per-thread scratch state in an array
+typedef void (*parallel_work_fn)(size_t index, int worker, void *arg);
+
+// Number of online CPUs, or 1 if it cannot be determined
+int parallel_default_jobs(void);
+
+// Parse a CPU list such as "0-3,8,10-11" into 'placement->cpus'
+// Returns 0 on success or -1 if 'list' is malformed or names too high a CPU
+int parallel_parse_cpus(const char *list, parallel_placement_t *placement);
+
+// Number of CPUs set in 'placement->cpus'
+int parallel_placement_cpus(const parallel_placement_t *placement);
+
+// Pin the calling thread, worker number 'worker' of a pool, as 'placement'
+// says: round robin over the CPUs in 'cpus', or over NUMA nodes with 'numa'
+// Returns 0 on success (including when there is nothing to pin) or -1 (with errno set)
+int parallel_place_worker(const parallel_placement_t *placement, int worker);
+
+// Run 'work' once for every index in [0, num_items) using up to 'num_jobs'
+// threads. Items are handed out dynamically so uneven items balance out.
+// A 'num_jobs' of 0 or less means parallel_default_jobs().
+// Returns 0 on success or -1 if no worker thread could be started
+int parallel_for(int num_jobs, size_t num_items, parallel_work_fn work, void *arg);
+
+// Same as parallel_for with every worker placed by parallel_place_worker
+// ('placement' may be NULL). The calling thread takes part as worker 0 and
+// gets its own CPU affinity back afterwards.
+int parallel_for_placed(const parallel_placement_t *placement, int num_jobs, size_t num_items,
+                        parallel_work_fn work, void *arg);
+
+#endif    // _PARALLEL_H
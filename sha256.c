@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "sha256.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_HAVE_SHANI 1
+#endif
+
+// Round constants defined by FIPS 180-4
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * Process 'num_blocks' consecutive 64-byte blocks starting at 'data'
+ * Portable version, used when the CPU has no SHA extensions
+ */
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    while (num_blocks-- > 0) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t) data[4 * i] << 24) | ((uint32_t) data[4 * i + 1] << 16) |
+                   ((uint32_t) data[4 * i + 2] << 8) | (uint32_t) data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + K[i] + w[i];
+            uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += SHA256_BLOCK_LEN;
+    }
+}
+
+#ifdef SHA256_HAVE_SHANI
+/*
+ * Same as sha256_blocks_generic, using the x86 SHA extensions (SHA-NI).
+ * The state is kept in the ABEF/CDGH register layout the instructions expect
+ * and each iteration of the round loop handles four rounds.
+ */
+__attribute__((target("sha,sse4.1"))) static void sha256_blocks_shani(uint32_t state[8],
+                                                                      const uint8_t *data,
+                                                                      size_t num_blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);     // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);          // CDGH
+
+    while (num_blocks-- > 0) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+
+        __m128i msgs[4];
+        for (int i = 0; i < 4; i++) {
+            msgs[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)),
+                                       byte_swap);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            __m128i msg = _mm_add_epi32(msgs[i & 3], _mm_loadu_si128((const __m128i *) &K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            // Expand the message schedule four words at a time:
+            // W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16]
+            if (i < 12) {
+                __m128i next = _mm_sha256msg1_epu32(msgs[i & 3], msgs[(i + 1) & 3]);
+                next = _mm_add_epi32(next,
+                                     _mm_alignr_epi8(msgs[(i + 3) & 3], msgs[(i + 2) & 3], 4));
+                msgs[i & 3] = _mm_sha256msg2_epu32(next, msgs[(i + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += SHA256_BLOCK_LEN;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);             // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);          // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);             // HGFE
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+/*
+ * Returns 1 if the CPU supports both the SHA extensions and SSE4.1
+ */
+static int cpu_has_shani(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx & bit_SHA) != 0;
+}
+#endif
+
+// Cached result of the CPU feature check: 0 = not checked yet, 1 = generic, 2 = SHA-NI
+static int sha256_impl = 0;
+
+/*
+ * Process whole blocks with the fastest implementation the CPU supports
+ */
+static void sha256_blocks(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    int impl = __atomic_load_n(&sha256_impl, __ATOMIC_RELAXED);
+    if (impl == 0) {
+        impl = 1;
+#ifdef SHA256_HAVE_SHANI
+        if (cpu_has_shani()) {
+            impl = 2;
+        }
+#endif
+        __atomic_store_n(&sha256_impl, impl, __ATOMIC_RELAXED);
+    }
+#ifdef SHA256_HAVE_SHANI
+    if (impl == 2) {
+        sha256_blocks_shani(state, data, num_blocks);
+        return;
+    }
+#endif
+    sha256_blocks_generic(state, data, num_blocks);
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->total_len = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    ctx->total_len += len;
+
+    // Top up a partially filled block first
+    if (ctx->buf_len > 0) {
+        size_t take = SHA256_BLOCK_LEN - ctx->buf_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(ctx->buf + ctx->buf_len, bytes, take);
+        ctx->buf_len += take;
+        bytes += take;
+        len -= take;
+        if (ctx->buf_len < SHA256_BLOCK_LEN) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+
+    // Hash whole blocks straight from the caller's buffer
+    size_t num_blocks = len / SHA256_BLOCK_LEN;
+    if (num_blocks > 0) {
+        sha256_blocks(ctx->state, bytes, num_blocks);
+        bytes += num_blocks * SHA256_BLOCK_LEN;
+        len -= num_blocks * SHA256_BLOCK_LEN;
+    }
+
+    memcpy(ctx->buf, bytes, len);
+    ctx->buf_len = len;
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_LEN]) {
+    uint64_t bit_len = ctx->total_len * 8;
+
+    // Padding: a single 1 bit, zeros, then the 64-bit big-endian message length
+    ctx->buf[ctx->buf_len++] = 0x80;
+    if (ctx->buf_len > SHA256_BLOCK_LEN - 8) {
+        memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_LEN - ctx->buf_len);
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+    memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_LEN - 8 - ctx->buf_len);
+    for (int i = 0; i < 8; i++) {
+        ctx->buf[SHA256_BLOCK_LEN - 1 - i] = (uint8_t) (bit_len >> (8 * i));
+    }
+    sha256_blocks(ctx->state, ctx->buf, 1);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * SHA256_DIGEST_LEN] = '\0';
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_BLOCK_LEN 64
+// Length of a digest printed as lowercase hex, including the null terminator
+#define SHA256_HEX_LEN (2 * SHA256_DIGEST_LEN + 1)
+
+// Running state of an incremental SHA-256 computation
+typedef struct {
+    uint32_t state[8];
+    uint64_t total_len;
+    uint8_t buf[SHA256_BLOCK_LEN];
+    size_t buf_len;
+} sha256_ctx_t;
+
+// Reset 'ctx' to begin hashing a new message
+void sha256_init(sha256_ctx_t *ctx);
+
+// Feed 'len' bytes from 'data' into the running hash
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+
+// Finish the hash and store the digest in 'digest'
+// 'ctx' must be re-initialized before it is used again
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// Convenience wrapper to hash a single buffer in one call
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// Write 'digest' as a null-terminated lowercase hex string into 'hex'
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN]);
+
+#endif    // _SHA256_H
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "tar_number.h"
+
+#include <string.h>
+
+// Every byte of a 64-bit word set to 'b'
+#define BYTES(b) (0x0101010101010101ULL * (b))
+
+/*
+ * Load up to 8 bytes of 'field' (padding with NULs) as a little-endian word,
+ * so byte i of the field is byte i of the word whatever the host order
+ */
+uint64_t load_chunk(const unsigned char *field, size_t len) {
+    uint64_t word = 0;
+    if (len >= 8) {
+        memcpy(&word, field, 8);
+    } else {
+        memcpy(&word, field, len);
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * Number of leading bytes of 'word' that are octal digits
+ */
+int octal_prefix_len(uint64_t word) {
+    // Zero exactly in the bytes '0'..'7'
+    uint64_t other = (word & BYTES(0xF8)) ^ BYTES(0x30);
+    // High bit set in every nonzero byte
+    uint64_t nonzero = (((other & BYTES(0x7F)) + BYTES(0x7F)) | other) & BYTES(0x80);
+    return nonzero == 0 ? 8 : __builtin_ctzll(nonzero) / 8;
+}
+
+/*
+ * Value of the 8 octal digits in 'word', most significant in byte 0, in
+ * three multiply-shift-mask steps that each join neighboring groups
+ */
+uint64_t octal_chunk_value(uint64_t word) {
+    uint64_t digits = word & BYTES(0x07);
+    digits = ((digits << 3) + (digits >> 8)) & 0x00FF00FF00FF00FFULL;
+    digits = ((digits << 6) + (digits >> 16)) & 0x0000FFFF0000FFFFULL;
+    return ((digits << 12) + (digits >> 32)) & 0xFFFFFFFFULL;
+}
+
+/*
+ * Decode the GNU base-256 form, with the marker bit in 'field[0]'
+ */
+int parse_base256(const unsigned char *field, size_t len, uint64_t *value) {
+    if (field[0] & 0x40) {
+        // Sign bit: negative, e.g. an mtime before 1970
+        return -1;
+    }
+    uint64_t result = field[0] & 0x3F;
+    for (size_t i = 1; i < len; i++) {
+        if (result >> 56 != 0) {
+            return -1;
+        }
+        result = (result << 8) | field[i];
+    }
+    *value = result;
+    return 0;
+}
+
+/*
+ * Decode octal digits followed by spaces and NULs from the first 'len' bytes
+ * of 'word' (the rest being NUL), which must not start with a space
+ * Returns 0 with the value in '*value' or -1 if a byte is out of place
+ */
+int parse_octal_word(uint64_t word, uint64_t *value) {
+    int num_digits = octal_prefix_len(word);
+    if (num_digits == 8) {
+        *value = octal_chunk_value(word);
+        return 0;
+    }
+    if (((word >> (8 * num_digits)) & ~BYTES(0x20)) != 0) {
+        return -1;
+    }
+    // Shift the digits up so the unused low bytes become leading zeros
+    *value = num_digits == 0 ? 0 : octal_chunk_value(word << (8 * (8 - num_digits)));
+    return 0;
+}
+
+/*
+ * Decode an octal field of any length: leading spaces, digits 8 at a time,
+ * then nothing but spaces and NULs
+ */
+int parse_octal_slow(const unsigned char *bytes, size_t len, uint64_t *value) {
+    size_t i = 0;
+    while (i < len && bytes[i] == ' ') {
+        i++;
+    }
+    uint64_t result = 0;
+    while (i < len) {
+        // Past the end of the field the chunk is padded with NULs, which end
+        // the digits there
+        uint64_t word = load_chunk(bytes + i, len - i);
+        int num_digits = octal_prefix_len(word);
+        if (num_digits == 0) {
+            break;
+        }
+        if (result >> (64 - 3 * num_digits) != 0) {
+            return -1;
+        }
+        result = (result << (3 * num_digits)) |
+                 octal_chunk_value(word << (8 * (8 - num_digits)));
+        i += num_digits;
+        if (num_digits < 8) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (bytes[i] != ' ' && bytes[i] != '\0') {
+            return -1;
+        }
+    }
+    *value = result;
+    return 0;
+}
+
+int tar_number_parse(const char *field, size_t len, uint64_t *value) {
+    const unsigned char *bytes = (const unsigned char *) field;
+    if (len > 0 && (bytes[0] & 0x80)) {
+        return parse_base256(bytes, len, value);
+    }
+    if (len == 0 || bytes[0] == ' ') {
+        return parse_octal_slow(bytes, len, value);
+    }
+
+    // The 8- and 12-byte fields of a header take one or two overlapping
+    // loads and no loop
+    if (len == 8) {
+        return parse_octal_word(load_chunk(bytes, 8), value);
+    }
+    if (len == 12) {
+        uint64_t head = load_chunk(bytes, 8);
+        // Bytes 8-11 in the low half, NULs above
+        uint64_t tail = load_chunk(bytes + 4, 8) >> 32;
+        if (octal_prefix_len(head) < 8) {
+            return (tail & ~BYTES(0x20)) == 0 ? parse_octal_word(head, value) : -1;
+        }
+        uint64_t tail_value;
+        if (parse_octal_word(tail, &tail_value) != 0) {
+            return -1;
+        }
+        int tail_digits = octal_prefix_len(tail);
+        *value = (octal_chunk_value(head) << (3 * tail_digits)) | tail_value;
+        return 0;
+    }
+    return parse_octal_slow(bytes, len, value);
+}
+
+int tar_number_format(char *field, size_t len, uint64_t value) {
+    if (len == 0) {
+        return -1;
+    }
+    // len - 1 octal digits leave room for the NUL
+    if (len - 1 >= 22 || value >> (3 * (len - 1)) == 0) {
+        for (size_t i = len - 1; i-- > 0; value >>= 3) {
+            field[i] = '0' + (value & 7);
+        }
+        field[len - 1] = '\0';
+        return 0;
+    }
+    // The first byte keeps its two high bits for the marker and the sign
+    if (len < 9 && value >> (8 * (len - 1) + 6) != 0) {
+        return -1;
+    }
+    for (size_t i = len; i-- > 1; value >>= 8) {
+        field[i] = (char) (value & 0xFF);
+    }
+    field[0] = (char) (0x80 | (value & 0x3F));
+    return 0;
+}
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _TAR_NUMBER_H
+#define _TAR_NUMBER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Decode a numeric tar header field of 'len' bytes, which need not be
+// null-terminated. Accepted are octal digits, optionally preceded by spaces
+// and followed only by spaces and NULs (an empty field is 0), and the GNU
+// base-256 form: high bit of the first byte set, the rest of the field a
+// big-endian binary number. Negative base-256 values are rejected.
+// Returns 0 with the value in '*value', or -1 if the field is malformed or
+// its value does not fit in 64 bits
+int tar_number_parse(const char *field, size_t len, uint64_t *value);
+
+// Encode 'value' into a numeric tar header field of 'len' bytes: zero-padded
+// octal digits and a NUL when they fit, otherwise the GNU base-256 form,
+// which holds up to 8 * len - 2 bits
+// Returns 0 on success or -1 if 'value' does not fit even in base 256
+int tar_number_format(char *field, size_t len, uint64_t value);
+
+#endif    // _TAR_NUMBER_H
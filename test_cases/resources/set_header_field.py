@@ -0,0 +1,23 @@
+#!/usr/bin/env python3
+# Overwrite the size or mtime field of the header at byte OFFSET of ARCHIVE
+# with VALUE (backslash escapes such as \0 and \x80 allowed) and fix up the
+# header checksum, to build archives with numbers spelled as other tools
+# may spell them.
+# usage: set_header_field.py ARCHIVE OFFSET size|mtime VALUE
+import sys
+
+FIELDS = {'size': 124, 'mtime': 136}
+archive, offset, field, value = sys.argv[1:]
+offset = int(offset)
+value = value.encode('latin-1').decode('unicode_escape').encode('latin-1')
+if len(value) != 12:
+    sys.exit('%s must be 12 bytes, not %d' % (field, len(value)))
+with open(archive, 'r+b') as f:
+    f.seek(offset)
+    header = bytearray(f.read(512))
+    start = FIELDS[field]
+    header[start:start + 12] = value
+    header[148:156] = b' ' * 8
+    header[148:156] = b'%06o\0 ' % sum(header)
+    f.seek(offset)
+    f.write(header)
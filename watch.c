@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// A batch is committed after this many debounce periods even if events keep arriving
+#define MAX_LATENCY_PERIODS 10
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+// A watched directory and which of its entries are of interest
+typedef struct {
+    int wd;
+    char dir[PATH_MAX];
+    int whole_dir;        // Every regular file in the directory is archived
+    file_list_t names;    // Otherwise only entries with these base names are
+} watch_dir_t;
+
+// Everything the event loop needs to decide whether a path belongs in a batch
+typedef struct {
+    minitar_ctx_t *ctx;
+    const char *archive_name;
+    const char *manifest_name;
+    watch_dir_t *dirs;
+    int num_dirs;
+} watch_state_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void watch_handle_signal(int sig) {
+    stop_requested = 1;
+}
+
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Split 'path' into the directory that contains it and its base name
+ */
+void split_path(const char *path, char *dir, size_t dir_len, const char **base) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        snprintf(dir, dir_len, ".");
+        *base = path;
+    } else if (slash == path) {
+        snprintf(dir, dir_len, "/");
+        *base = slash + 1;
+    } else {
+        snprintf(dir, dir_len, "%.*s", (int) (slash - path), path);
+        *base = slash + 1;
+    }
+}
+
+/*
+ * Returns 1 if 'a' and 'b' name the same existing file, 0 otherwise
+ */
+int same_file(const char *a, const char *b) {
+    struct stat stat_a, stat_b;
+    return stat(a, &stat_a) == 0 && stat(b, &stat_b) == 0 && stat_a.st_dev == stat_b.st_dev &&
+           stat_a.st_ino == stat_b.st_ino;
+}
+
+/*
+ * Returns 1 if 'path' in 'dir' is the archive itself, its manifest, or one of
+ * its sidecar files ("<archive>.merkle", "<archive>.ckpt", ...).
+ * Appending to the archive generates events of its own, which must not
+ * trigger yet another append.
+ */
+int is_own_file(const watch_state_t *state, const char *dir, const char *base, const char *path) {
+    if (same_file(path, state->archive_name) ||
+        (state->manifest_name != NULL && same_file(path, state->manifest_name))) {
+        return 1;
+    }
+    char archive_dir[PATH_MAX];
+    const char *archive_base;
+    split_path(state->archive_name, archive_dir, sizeof(archive_dir), &archive_base);
+    size_t base_len = strlen(archive_base);
+    return strncmp(base, archive_base, base_len) == 0 && base[base_len] == '.' &&
+           same_file(dir, archive_dir);
+}
+
+/*
+ * Add 'path' to the pending batch if it is a regular file that should be archived
+ */
+void queue_path(const watch_state_t *state, const char *dir, const char *base,
+                file_list_t *pending) {
+    minitar_ctx_t *ctx = state->ctx;
+    char path[PATH_MAX];
+    if (strcmp(dir, ".") == 0) {
+        snprintf(path, sizeof(path), "%s", base);
+    } else if (snprintf(path, sizeof(path), "%s/%s", dir, base) >= (int) sizeof(path)) {
+        return;
+    }
+
+    struct stat stat_buf;
+    if (stat(path, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode) ||
+        is_own_file(state, dir, base, path) || file_list_contains(pending, path)) {
+        return;
+    }
+    if (strlen(path) >= sizeof(((tar_header *) NULL)->name)) {
+        minitar_error(ctx, "Skipping %s: name is too long to archive", path);
+        return;
+    }
+    if (file_list_add(pending, path) != 0) {
+        minitar_perror(ctx, "Failed to queue changed file");
+    }
+}
+
+/*
+ * Queue every watched file, used when the kernel dropped events and the exact
+ * set of changes is unknown
+ */
+void queue_everything(const watch_state_t *state, file_list_t *pending) {
+    for (int i = 0; i < state->num_dirs; i++) {
+        watch_dir_t *watch = &state->dirs[i];
+        if (!watch->whole_dir) {
+            file_list_iter_t iter;
+            for (const char *name = file_list_first(&watch->names, &iter); name != NULL;
+                 name = file_list_next(&iter)) {
+                queue_path(state, watch->dir, name, pending);
+            }
+            continue;
+        }
+        DIR *dir = opendir(watch->dir);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            queue_path(state, watch->dir, entry->d_name, pending);
+        }
+        closedir(dir);
+    }
+}
+
+/*
+ * Start watching 'path', merging it into an existing watch on the same directory
+ * Returns 0 on success or -1 if an error occurs
+ */
+int add_watch_path(int inotify_fd, watch_state_t *state, const char *path) {
+    minitar_ctx_t *ctx = state->ctx;
+    struct stat stat_buf;
+    if (stat(path, &stat_buf) != 0) {
+        minitar_perror(ctx, "Failed to stat %s", path);
+        return -1;
+    }
+
+    // Files are watched through their directory so editors that replace a
+    // file by renaming a new one over it are still noticed
+    char dir[PATH_MAX];
+    const char *base = NULL;
+    if (S_ISDIR(stat_buf.st_mode)) {
+        snprintf(dir, sizeof(dir), "%s", path);
+    } else {
+        split_path(path, dir, sizeof(dir), &base);
+    }
+
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS);
+    if (wd == -1) {
+        minitar_perror(ctx, "Failed to watch %s", path);
+        return -1;
+    }
+
+    watch_dir_t *watch = NULL;
+    for (int i = 0; i < state->num_dirs; i++) {
+        if (state->dirs[i].wd == wd) {
+            watch = &state->dirs[i];
+        }
+    }
+    if (watch == NULL) {
+        watch_dir_t *dirs =
+            minitar_realloc(ctx, state->dirs, (state->num_dirs + 1) * sizeof(watch_dir_t));
+        if (dirs == NULL) {
+            minitar_perror(ctx, "Failed to allocate watch list");
+            return -1;
+        }
+        state->dirs = dirs;
+        watch = &state->dirs[state->num_dirs++];
+        watch->wd = wd;
+        snprintf(watch->dir, sizeof(watch->dir), "%s", dir);
+        watch->whole_dir = 0;
+        file_list_init_with(&watch->names, &ctx->allocator);
+    }
+
+    if (base == NULL) {
+        watch->whole_dir = 1;
+    } else if (!file_list_contains(&watch->names, base) &&
+               file_list_add(&watch->names, base) != 0) {
+        minitar_perror(ctx, "Failed to allocate watch list");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Append the pending batch to the archive as one group commit and empty it
+ * Returns 0 on success or -1 if an error occurs
+ */
+int commit_batch(minitar_ctx_t *ctx, const char *archive_name, file_list_t *pending) {
+    if (pending->size == 0) {
+        return 0;
+    }
+    int ret = append_files_to_archive(ctx, archive_name, pending);
+    file_list_clear(pending);
+    return ret;
+}
+
+int watch_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *paths,
+                  int debounce_ms) {
+    if (access(archive_name, F_OK) != 0) {
+        minitar_error(ctx, "Archive %s must exist before it can be watched", archive_name);
+        return -1;
+    }
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        minitar_perror(ctx, "Failed to initialize inotify");
+        return -1;
+    }
+
+    watch_state_t state = {ctx, archive_name, ctx->opts.manifest_out, NULL, 0};
+    file_list_t pending;
+    file_list_init_with(&pending, &ctx->allocator);
+    int ret = 0;
+
+    file_list_iter_t iter;
+    for (const char *path = file_list_first(paths, &iter); path != NULL;
+         path = file_list_next(&iter)) {
+        if (add_watch_path(inotify_fd, &state, path) != 0) {
+            ret = -1;
+            goto done;
+        }
+    }
+
+    // No SA_RESTART, so a signal interrupts poll() and the loop can wind down
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watch_handle_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    long long batch_start_ms = 0;
+    char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!stop_requested) {
+        int poll_ret = poll(&pfd, 1, pending.size > 0 ? debounce_ms : -1);
+        if (poll_ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            minitar_perror(ctx, "Failed to wait for file changes");
+            ret = -1;
+            break;
+        }
+
+        if (poll_ret == 0) {
+            // Quiet for a whole debounce period, the burst is over
+            if (commit_batch(ctx, archive_name, &pending) != 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        ssize_t len;
+        while ((len = read(inotify_fd, events, sizeof(events))) > 0) {
+            for (char *ptr = events; ptr < events + len;) {
+                struct inotify_event *event = (struct inotify_event *) ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    queue_everything(&state, &pending);
+                    continue;
+                }
+                for (int i = 0; i < state.num_dirs; i++) {
+                    watch_dir_t *watch = &state.dirs[i];
+                    if (watch->wd == event->wd && event->len > 0 &&
+                        (watch->whole_dir || file_list_contains(&watch->names, event->name))) {
+                        if (pending.size == 0) {
+                            batch_start_ms = monotonic_ms();
+                        }
+                        queue_path(&state, watch->dir, event->name, &pending);
+                    }
+                }
+            }
+        }
+
+        // Don't let a constant stream of events postpone the commit forever
+        if (pending.size > 0 &&
+            monotonic_ms() - batch_start_ms >= (long long) debounce_ms * MAX_LATENCY_PERIODS) {
+            if (commit_batch(ctx, archive_name, &pending) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    // Changes that arrived before shutdown still make it into the archive
+    if (ret == 0 && commit_batch(ctx, archive_name, &pending) != 0) {
+        ret = -1;
+    }
+
+done:
+    file_list_clear(&pending);
+    for (int i = 0; i < state.num_dirs; i++) {
+        file_list_clear(&state.dirs[i].names);
+    }
+    minitar_free(ctx, state.dirs);
+    close(inotify_fd);
+    return ret;
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include "file_list.h"
+#include "minitar.h"
+
+// Default quiet period (milliseconds) before a batch of changes is appended
+#define WATCH_DEFAULT_DEBOUNCE_MS 500
+
+/*
+ * Keep the archive identified by 'archive_name' up to date with the files in
+ * 'paths' until interrupted by SIGINT or SIGTERM.
+ * Each entry of 'paths' is either a file, which is appended whenever it is
+ * written or replaced, or a directory, whose regular files (not recursively)
+ * are appended whenever they are written or moved into it.
+ * Changes are collected until no new event has arrived for 'debounce_ms'
+ * milliseconds and then appended together in one call to
+ * append_files_to_archive, so a burst of writes costs a single append.
+ * The signal handlers installed here are process-wide, so only one watch
+ * should run per process.
+ * This function should return 0 upon a clean shutdown or -1 if an error occurred.
+ */
+int watch_archive(minitar_ctx_t *ctx, const char *archive_name, const file_list_t *paths,
+                  int debounce_ms);
+
+#endif    // _WATCH_H